@@ -1,16 +1,123 @@
 #ifndef _LIBTHREAD_THREADPOOL_H
 #define _LIBTHREAD_THREADPOOL_H
 
+#include <assert.h>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
 namespace LibThread {
   class ThreadPool;
   class Job;
+  class JobGroup;
+  // what to do when a job is submitted to a pool with a full queue
+  enum QueuePolicy {
+    QueueBlock,  // wait until there is room
+    QueueFail,   // reject the job
+    QueueInline  // run the job in the submitting thread
+  };
   // thread pools
   ThreadPool *createThreadPool(int threads, int prioThreads = 0);
   void closeThreadPool(ThreadPool *pool, bool wait);
   ThreadPool *getCurrentThreadPool();
+  void setMemoryLimit(ThreadPool *pool, long bytes);
+  void setQueueLimit(ThreadPool *pool, long limit,
+    QueuePolicy policy = QueueBlock);
+  void setSpinLimit(ThreadPool *pool, long spins);
+  // process-wide core budget shared by all pools (0 = unlimited)
+  void setCoreBudget(long cores);
+  void setThreadPoolWeight(ThreadPool *pool, long weight);
+  // memoization of proc job results (0 entries = disabled, 0 bytes =
+  // no limit on the total size of keys and results)
+  void setResultCache(ThreadPool *pool, long entries, long bytes = 0);
+  void getResultCacheStats(ThreadPool *pool, long *hits, long *misses,
+    long *entries, long *bytes = NULL);
+  // persistent cache of proc job results in a directory ("" = disabled)
+  bool setDiskCache(ThreadPool *pool, const char *dir, long bytes,
+    const char *version);
   // job creation
   Job *createJob(void (*func)(leftv result, leftv arg));
   Job *createJob(void (*func)(long ndeps, Job **deps));
+  // a new job sharing the (encoded) arguments of a template job
+  Job *createJob(Job *tmpl, leftv arg);
+  Job *createJob(Job *tmpl);
+  // native jobs: C++ functions whose arguments and results stay on the
+  // shared heap and are never serialized
+  class NativeJobBody {
+  public:
+    virtual ~NativeJobBody() { }
+    virtual void run() = 0;
+  };
+  template <typename R>
+  class NativeJobResult : public NativeJobBody {
+  public:
+    std::function<R()> func;
+    R result;
+    NativeJobResult(std::function<R()> f) : func(std::move(f)), result() { }
+    virtual void run() {
+      result = func();
+      func = nullptr; // drop bound arguments
+    }
+  };
+  template <>
+  class NativeJobResult<void> : public NativeJobBody {
+  public:
+    std::function<void()> func;
+    NativeJobResult(std::function<void()> f) : func(std::move(f)) { }
+    virtual void run() {
+      func();
+      func = nullptr;
+    }
+  };
+  Job *createNativeJob(NativeJobBody *body);
+  NativeJobBody *getNativeJobBody(Job *job); // NULL if not a native job
+  template <std::size_t... I> struct IndexList { };
+  template <std::size_t N, std::size_t... I>
+  struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> { };
+  template <std::size_t... I>
+  struct MakeIndexList<0, I...> { typedef IndexList<I...> type; };
+  // A function with bound arguments that are moved into the call, so
+  // that move-only arguments can be bound (std::bind passes them as
+  // lvalues); it can only be called once. Copies share the arguments.
+  template <typename R, typename F, typename... Args>
+  class NativeJobCall {
+  private:
+    typedef std::tuple<F, Args...> State;
+    std::shared_ptr<State> state;
+    template <std::size_t... I>
+    R call(IndexList<I...>) {
+      return std::move(std::get<0>(*state))(
+        std::move(std::get<I + 1>(*state))...);
+    }
+  public:
+    template <typename G, typename... Bound>
+    NativeJobCall(G &&func, Bound&&... args) :
+      state(std::make_shared<State>(std::forward<G>(func),
+        std::forward<Bound>(args)...)) { }
+    R operator()() {
+      return call(typename MakeIndexList<sizeof...(Args)>::type());
+    }
+  };
+  template <typename R, typename... Params, typename... Args>
+  Job *createJob(std::function<R(Params...)> func, Args&&... args) {
+    typedef NativeJobCall<R, std::function<R(Params...)>,
+      typename std::decay<Args>::type...> Call;
+    return createNativeJob(new NativeJobResult<R>(
+      Call(std::move(func), std::forward<Args>(args)...)));
+  }
+  // The result of a finished native job; it can be moved out. The job
+  // must have been created with a function returning R.
+  template <typename R>
+  R &getJobResult(Job *job) {
+    NativeJobBody *body = getNativeJobBody(job);
+    assert(body != NULL);
+    NativeJobResult<R> *native = dynamic_cast<NativeJobResult<R> *>(body);
+    assert(native != NULL);
+    return native->result;
+  }
   // job status
   Job *getCurrentJob();
   bool getJobCancelled();
@@ -18,20 +125,63 @@ namespace LibThread {
   void addJobArgs(Job *job, leftv arg);
   void setJobData(Job *job, void *data);
   void *getJobData(Job *job);
+  void setJobMemory(Job *job, long bytes);
+  // drop the result once all dependents have read it (or, without
+  // dependents, once it has been retrieved)
+  void setJobResultOnce(Job *job);
+  // NULL if the job has no result or its consume-once result is gone
   leftv getJobResult(Job *job);
   const char *getJobName();
   void setJobName(const char *);
   // Job scheduling
   Job *startJob(ThreadPool *pool, Job *job, leftv arg);
   Job *startJob(ThreadPool *pool, Job *job);
+  // start a job on a specific worker; workers are numbered from 0 here,
+  // while the startJobOn() interpreter builtin numbers them from 1
+  Job *startJobOn(ThreadPool *pool, int worker, Job *job, leftv arg);
+  Job *startJobOn(ThreadPool *pool, int worker, Job *job);
+  // the dependencies must have been started on the same pool; returns
+  // NULL otherwise
   Job *scheduleJob(ThreadPool *pool, Job *job, long ndeps, Job **deps);
+  // futures: schedule jobs that run once other jobs have finished; all
+  // jobs must belong to the same pool
+  Job *then(Job *job, Job *cont);
+  Job *whenAll(long njobs, Job **jobs);
+  Job *whenAny(long njobs, Job **jobs);
   void cancelJob(Job *job);
   void waitJob(Job *job);
-  // reference counting
+  // run func(job, data) on the thread that finishes the job
+  void onJobDone(Job *job, void (*func)(Job *job, void *data), void *data);
+  // streams: the current job emits values that others consume with
+  // jobNext while it runs; jobNext returns NULL once the job has finished
+  // and all values have been consumed. Dependent jobs still only start
+  // once the job has finished.
+  void jobEmit(leftv value);
+  leftv jobNext(Job *job);
+  void setJobStreamCapacity(Job *job, long capacity);
+  // wait until count of the jobs have finished; stores the (0-based)
+  // indices of all finished jobs and returns their number
+  long waitJobs(long njobs, Job **jobs, long count, long *finished);
+  // apply func to each generator of ideal (in the current ring) in
+  // chunks and return the ideal of the results; shared is encoded once
+  // and decoded once per worker, func takes ownership of its argument
+  ideal mapIdeal(ThreadPool *pool, ideal J, leftv shared,
+    poly (*func)(poly p, leftv shared), long chunk);
+  // job groups: jobs scheduled while a group is current join it
+  JobGroup *createJobGroup(JobGroup *parent = NULL);
+  JobGroup *getCurrentJobGroup();
+  void setCurrentJobGroup(JobGroup *group);
+  void waitGroup(JobGroup *group);
+  void cancelGroup(JobGroup *group);
+  // reference counting: pools, jobs and groups returned by the create
+  // functions, whenAll, and whenAny hold a reference owned by the
+  // caller; objects are freed once their last reference is released
   void release(Job *job);
   void release(ThreadPool *pool);
+  void release(JobGroup *group);
   void retain(Job *job);
   void retain(ThreadPool *pool);
+  void retain(JobGroup *group);
 }
 
 #endif
@@ -49,6 +49,7 @@ using namespace std;
 vector<LinTreeEncodeFunc> encoders;
 vector<LinTreeDecodeFunc> decoders;
 vector<LinTreeRefFunc> refupdaters;
+vector<LinTreeObjRefFunc> objrefupdaters;
 vector<char> needs_ring;
 
 void install(int typ,
@@ -67,6 +68,7 @@ void install(int typ,
     encoders.resize(n);
     decoders.resize(n);
     refupdaters.resize(n);
+    objrefupdaters.resize(n);
     needs_ring.resize(n);
   }
   encoders[typ] = enc;
@@ -74,6 +76,10 @@ void install(int typ,
   refupdaters[typ] = ref;
 }
 
+void install_objref(int typ, LinTreeObjRefFunc ref) {
+  objrefupdaters[typ] = ref;
+}
+
 void set_needs_ring(int typ) {
   needs_ring[typ] = 1;
 }
@@ -101,9 +107,17 @@ void encode(LinTree &lintree, leftv val) {
     lintree.mark_error("trying to share unsupported data type");
 }
 
+// Precedes the list of objects that an encoding refers to.
+#define REFS_HEADER (-2)
+
 leftv decode(LinTree &lintree) {
   ring decode_ring_raw(LinTree &lintree);
   int typ = lintree.get_int();
+  if (typ == REFS_HEADER) {
+    int n = lintree.get_int();
+    lintree.skip_bytes(n * (sizeof(int) + sizeof(void *)));
+    typ = lintree.get_int();
+  }
   if (typ < 0) {
     lintree.set_last_ring(decode_ring_raw(lintree));
     typ = lintree.get_int();
@@ -851,7 +865,37 @@ std::string to_string(leftv val) {
     lintree.clear();
     lintree.put_int(NONE);
   }
-  return lintree.to_string();
+  if (!lintree.has_refs())
+    return lintree.to_string();
+  LinTree header;
+  header.put_int(REFS_HEADER);
+  header.put_int(lintree.num_refs());
+  header.to_string().append(lintree.get_refs());
+  std::string result = header.to_string() + lintree.to_string();
+  updaterefs(result, 1);
+  return result;
+}
+
+int updaterefs(std::string &str, int by) {
+  int marker, n;
+  if (str.size() < 2 * sizeof(int))
+    return 0;
+  memcpy(&marker, str.c_str(), sizeof(int));
+  if (marker != REFS_HEADER)
+    return 0;
+  memcpy(&n, str.c_str() + sizeof(int), sizeof(int));
+  if (by != 0) {
+    const char *p = str.c_str() + 2 * sizeof(int);
+    for (int i = 0; i < n; i++) {
+      int typ;
+      void *obj;
+      memcpy(&typ, p, sizeof(int));
+      memcpy(&obj, p + sizeof(int), sizeof(void *));
+      p += sizeof(int) + sizeof(void *);
+      objrefupdaters[typ](obj, by);
+    }
+  }
+  return n;
 }
 
 leftv from_string(std::string &str) {
@@ -882,22 +926,25 @@ void init() {
   set_needs_ring(IDEAL_CMD);
 }
 
-LinTree::LinTree() : cursor(0), memory(*new string()), error(NULL), last_ring(NULL) {
+LinTree::LinTree() : cursor(0), memory(*new string()), error(NULL), last_ring(NULL), refs(), nrefs(0) {
 }
 
-LinTree::LinTree(const LinTree &other) : cursor(0), memory(*new string(other.memory)), error(NULL), last_ring(NULL) {
+LinTree::LinTree(const LinTree &other) : cursor(0), memory(*new string(other.memory)), error(NULL), last_ring(NULL), refs(other.refs), nrefs(other.nrefs) {
 }
 
 LinTree& LinTree::operator =(const LinTree &other) {
   cursor = other.cursor;
-  memory = *new string(other.memory);
+  memory = other.memory;
   error = NULL;
   last_ring = NULL;
+  refs = other.refs;
+  nrefs = other.nrefs;
   return *this;
 }
 
 LinTree::LinTree(std::string &source) :
-  cursor(0), memory(*new string(source)), error(NULL), last_ring(NULL) {
+  cursor(0), memory(*new string(source)), error(NULL), last_ring(NULL),
+  refs(), nrefs(0) {
 }
 
 void LinTree::set_last_ring(void *r) {
@@ -908,6 +955,7 @@ void LinTree::set_last_ring(void *r) {
 }
 
 LinTree::~LinTree() {
+  delete &memory;
   if (last_ring)
     rKill((ring) last_ring);
 }
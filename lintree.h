@@ -13,6 +13,7 @@ class LinTree;
 typedef void (*LinTreeEncodeFunc)(LinTree &lintree, leftv val);
 typedef leftv (*LinTreeDecodeFunc)(LinTree &lintree);
 typedef void (*LinTreeRefFunc)(LinTree &lintree, int by);
+typedef void (*LinTreeObjRefFunc)(void *obj, int by);
 
 extern std::vector<LinTreeEncodeFunc> encoders;
 extern std::vector<LinTreeDecodeFunc> decoders;
@@ -20,6 +21,9 @@ extern std::vector<LinTreeRefFunc> refupdaters;
 
 void install(int typ, LinTreeEncodeFunc enc, LinTreeDecodeFunc dec,
   LinTreeRefFunc ref);
+// Updates the references of objects of type typ recorded with put_ref();
+// typ must have been installed before.
+void install_objref(int typ, LinTreeObjRefFunc ref);
 
 class LinTree {
 private:
@@ -27,6 +31,8 @@ private:
   size_t cursor;
   const char * error;
   void *last_ring;
+  std::string refs; // type and address of each referenced object
+  int nrefs;
 public:
   LinTree();
   LinTree(const LinTree &other);
@@ -34,7 +40,10 @@ public:
   LinTree(std::string &source);
   LinTree& operator=(const LinTree &other);
   void rewind() { cursor = 0; }
-  void clear() { memory.clear(); cursor = 0; error = NULL; last_ring = NULL; }
+  void clear() {
+    memory.clear(); cursor = 0; error = NULL; last_ring = NULL;
+    refs.clear(); nrefs = 0;
+  }
   void mark_error(const char *s) {
     error = s;
   }
@@ -117,6 +126,22 @@ public:
   std::string &to_string() {
     return memory;
   }
+  // Record that the encoding refers to the object p of type typ, which
+  // must stay alive as long as the encoding does.
+  void put_ref(int typ, void *p) {
+    refs.append((const char *) &typ, sizeof(typ));
+    refs.append((const char *) &p, sizeof(p));
+    nrefs++;
+  }
+  int has_refs() {
+    return nrefs > 0;
+  }
+  std::string &get_refs() {
+    return refs;
+  }
+  int num_refs() {
+    return nrefs;
+  }
   void set_last_ring(void *r);
   int has_last_ring() {
     return last_ring != NULL;
@@ -128,6 +153,18 @@ public:
 
 std::string to_string(leftv val);
 leftv from_string(std::string &str);
+// An encoding made by to_string() holds a reference to each object
+// recorded with put_ref(), listed in a header; these are updated by
+// the ref functions of their types. Returns the number of objects.
+int updaterefs(std::string &str, int by);
+
+// values in sequence; ring-dependent values after the first one share
+// its ring, which is written only once
+void encode(LinTree &lintree, leftv val);
+leftv decode(LinTree &lintree);
+// raw polynomials, without type or ring information
+void encode_poly(LinTree &lintree, int typ, poly p, const ring r);
+poly decode_poly(LinTree &lintree, const ring r);
 
 void init();
 
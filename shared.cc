@@ -17,15 +17,27 @@
 #include <string>
 #include <errno.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <vector>
 #include <map>
+#include <list>
+#include <unordered_map>
 #include <iterator>
 #include <queue>
+#include <algorithm>
+#include <atomic>
+#include <sched.h>
 #include <assert.h>
 #include "thread.h"
 #include "lintree.h"
 
 #include "singthreads.h"
+#include "libthread.h"
 
 using namespace std;
 
@@ -41,6 +53,63 @@ const int have_threads = 1;
 const int have_threads = 0;
 #endif
 
+// Epoch-based reclamation of shared objects.
+//
+// An object whose reference count drops to zero is retired rather than
+// deleted, because other threads may still use pointers to it that do
+// not own a reference; e.g., an interpreter builtin holds a new job
+// without a reference while a worker may already have run and released
+// it. Such code runs inside an epoch guard. A retired object is only
+// deleted once all threads that were inside a guard when it was retired
+// have left it, and is kept if it has been acquired again in between.
+
+struct EpochRecord {
+  std::atomic<unsigned long> epoch;
+  std::atomic<bool> active;
+  int depth; // guard nesting, only used by the owning thread
+};
+
+static std::atomic<unsigned long> global_epoch(1);
+static Lock reclaim_lock;
+static vector<EpochRecord *> epoch_records; // one per thread, never freed
+static SIMPLE_THREAD_VAR EpochRecord *epochRecordRef;
+
+static void enterEpoch() {
+  EpochRecord *rec = epochRecordRef;
+  if (!rec) {
+    rec = new EpochRecord();
+    rec->epoch = 0;
+    rec->active = false;
+    rec->depth = 0;
+    reclaim_lock.lock();
+    epoch_records.push_back(rec);
+    reclaim_lock.unlock();
+    epochRecordRef = rec;
+  }
+  if (rec->depth++ == 0) {
+    // Until the new epoch is stored, the old one keeps objects alive.
+    rec->active = true;
+    rec->epoch = global_epoch.load();
+  }
+}
+
+// Returns true if the thread has left its outermost guard.
+static bool exitEpoch() {
+  EpochRecord *rec = epochRecordRef;
+  if (--rec->depth > 0)
+    return false;
+  rec->active = false;
+  return true;
+}
+
+class EpochGuard {
+public:
+  EpochGuard() { enterEpoch(); }
+  ~EpochGuard() { exitEpoch(); }
+};
+
+static void maybeReclaimShared();
+
 class Command {
 private:
   const char *name;
@@ -51,6 +120,7 @@ private:
 public:
   Command(const char *n, leftv r, leftv a)
   {
+    enterEpoch();
     name = n;
     result = r;
     error = NULL;
@@ -68,6 +138,8 @@ public:
   }
   ~Command() {
     omFree(args);
+    if (exitEpoch())
+      maybeReclaimShared();
   }
   void check_argc(int n) {
     if (error) return;
@@ -154,36 +226,59 @@ public:
   }
 };
 
+// Number of live shared objects by type. Blackbox types are numbered
+// from above MAX_TOK, so each gets a slot of its own; objects whose type
+// has not been set (type 0) share slot 0. Counters are only updated
+// atomically, so that creating objects never contends for a lock.
+#define MAX_SHARED_TYPES 256
+static std::atomic<long> live_objects[MAX_SHARED_TYPES + 1];
+
+static inline int statsSlot(int type) {
+  int slot = type - MAX_TOK;
+  return slot > 0 && slot <= MAX_SHARED_TYPES ? slot : 0;
+}
+
+static inline void countShared(int from, int to) {
+  if (from >= 0)
+    live_objects[statsSlot(from)].fetch_sub(1, std::memory_order_relaxed);
+  if (to >= 0)
+    live_objects[statsSlot(to)].fetch_add(1, std::memory_order_relaxed);
+}
+
 class SharedObject {
 private:
-  Lock lock;
-  long refcount;
+  std::atomic<long> refcount;
   int type;
   std::string name;
 public:
-  SharedObject(): lock(), refcount(0) { }
-  virtual ~SharedObject() { }
-  void set_type(int type_init) { type = type_init; }
+  // Owned by the reclamation code, protected by reclaim_lock.
+  bool retired;
+  unsigned long retire_epoch;
+  SharedObject(): refcount(0), type(0), retired(false), retire_epoch(0) {
+    countShared(-1, 0);
+  }
+  virtual ~SharedObject() { countShared(type, -1); }
+  void set_type(int type_init) {
+    countShared(type, type_init);
+    type = type_init;
+  }
   int get_type() { return type; }
   void set_name(std::string &name_init) { name = name_init; }
   void set_name(const char *s) {
     name = std::string(s);
   }
   std::string &get_name() { return name; }
-  void incref(int by = 1) {
-    lock.lock();
-    refcount += 1;
-    lock.unlock();
+  // Taking a reference needs no ordering, as the caller already holds
+  // one; dropping one must publish all prior writes to the thread that
+  // drops the last reference.
+  void incref(long by = 1) {
+    refcount.fetch_add(by, std::memory_order_relaxed);
   }
-  long decref() {
-    int result;
-    lock.lock();
-    result = --refcount;
-    lock.unlock();
-    return result;
+  long decref(long by = 1) {
+    return refcount.fetch_sub(by, std::memory_order_acq_rel) - by;
   }
   long getref() {
-    return refcount;
+    return refcount.load(std::memory_order_relaxed);
   }
   virtual BOOLEAN op2(int op, leftv res, leftv a1, leftv a2) {
     return TRUE;
@@ -197,10 +292,104 @@ void acquireShared(SharedObject *obj) {
   obj->incref();
 }
 
-void releaseShared(SharedObject *obj) {
-  if (obj->decref() == 0) {
-    // delete obj;
+static vector<SharedObject *> retired_objects;
+static std::atomic<long> retired_count(0);
+static std::atomic<long> reclaim_threshold(64);
+
+static void retireShared(SharedObject *obj) {
+  reclaim_lock.lock();
+  // An object that was acquired and released again after it had been
+  // retired must wait for the guards entered in the meantime, too.
+  obj->retire_epoch = global_epoch.load();
+  if (!obj->retired) {
+    obj->retired = true;
+    retired_objects.push_back(obj);
+    retired_count++;
+  }
+  reclaim_lock.unlock();
+}
+
+// Delete the retired objects that no thread can access anymore. Must
+// be called without holding any locks, as the destructors release
+// other objects and take locks of their own.
+static void reclaimShared() {
+  vector<SharedObject *> victims;
+  reclaim_lock.lock();
+  unsigned long epoch = global_epoch.load();
+  bool advance = true;
+  for (int i = 0; i < epoch_records.size(); i++) {
+    EpochRecord *rec = epoch_records[i];
+    if (rec->active && rec->epoch != epoch)
+      advance = false;
+  }
+  // Once all active threads have seen the current epoch, anything
+  // retired before can only be reached by guards of that epoch or
+  // later ones.
+  if (advance)
+    global_epoch = ++epoch;
+  unsigned long oldest = epoch;
+  for (int i = 0; i < epoch_records.size(); i++) {
+    EpochRecord *rec = epoch_records[i];
+    if (rec->active && rec->epoch < oldest)
+      oldest = rec->epoch;
+  }
+  int kept = 0;
+  for (int i = 0; i < retired_objects.size(); i++) {
+    SharedObject *obj = retired_objects[i];
+    if (obj->getref() > 0)
+      obj->retired = false;
+    else if (obj->retire_epoch < oldest)
+      victims.push_back(obj);
+    else
+      retired_objects[kept++] = obj;
   }
+  retired_objects.resize(kept);
+  retired_count = kept;
+  reclaim_threshold = std::max(64L, 2L * kept);
+  reclaim_lock.unlock();
+  for (int i = 0; i < victims.size(); i++)
+    delete victims[i];
+}
+
+// Reclaim objects only once enough of them have been retired, so that
+// the cost of scanning the epochs is amortized.
+static bool reclaimDue() {
+  return retired_count.load(std::memory_order_relaxed) >=
+    reclaim_threshold.load(std::memory_order_relaxed);
+}
+
+static void maybeReclaimShared() {
+  if (reclaimDue())
+    reclaimShared();
+}
+
+// Releasing a reference never deletes the object directly; it is safe
+// to call with locks held.
+void releaseShared(SharedObject *obj) {
+  if (obj->decref() == 0)
+    retireShared(obj);
+}
+
+// An encoding of a value holds a reference to each shared object in it.
+// Every copy of an encoding that is stored or handed on owns these
+// references; whoever drops the copy must release them.
+static void acquireEncoding(string &s) {
+  LinTree::updaterefs(s, 1);
+}
+
+static void releaseEncoding(string &s) {
+  LinTree::updaterefs(s, -1);
+}
+
+static void releaseEncodings(vector<string> &v) {
+  for (int i = 0; i < v.size(); i++)
+    releaseEncoding(v[i]);
+}
+
+// Encodings that refer to shared objects depend on their current state
+// and address, so they are neither cached nor used as cache keys.
+static bool holdsReferences(string &s) {
+  return LinTree::updaterefs(s, 0) > 0;
 }
 
 typedef std::map<std::string, SharedObject *> SharedObjectTable;
@@ -211,7 +400,11 @@ private:
 public:
   SharedObjectTable objects;
   Region() : SharedObject(), region_lock(), objects() { }
-  virtual ~Region() { }
+  virtual ~Region() {
+    SharedObjectTable::iterator it;
+    for (it = objects.begin(); it != objects.end(); it++)
+      releaseShared(it->second);
+  }
   Lock *get_lock() { return &region_lock; }
   void lock() {
     if (!region_lock.is_locked())
@@ -245,6 +438,7 @@ int type_thread;
 int type_threadpool;
 int type_job;
 int type_trigger;
+int type_jobgroup;
 
 typedef SharedObject *SharedObjectPtr;
 typedef SharedObjectPtr (*SharedConstructor)();
@@ -252,6 +446,7 @@ typedef SharedObjectPtr (*SharedConstructor)();
 SharedObject *makeSharedObject(SharedObjectTable &table,
   Lock *lock, int type, string &name, SharedConstructor scons)
 {
+  EpochGuard guard;
   int was_locked = lock->is_locked();
   SharedObject *result = NULL;
   if (!was_locked)
@@ -264,6 +459,7 @@ SharedObject *makeSharedObject(SharedObjectTable &table,
     result = scons();
     result->set_type(type);
     result->set_name(name);
+    acquireShared(result); // owned by the table
     table.insert(pair<string,SharedObject *>(name, result));
   }
   if (!was_locked)
@@ -274,6 +470,7 @@ SharedObject *makeSharedObject(SharedObjectTable &table,
 SharedObject *findSharedObject(SharedObjectTable &table,
   Lock *lock, string &name)
 {
+  EpochGuard guard;
   int was_locked = lock->is_locked();
   SharedObject *result = NULL;
   if (!was_locked)
@@ -325,11 +522,20 @@ private:
   std::map<string, string> entries;
 public:
   TxTable() : Transactional(), entries() { }
-  virtual ~TxTable() { }
+  virtual ~TxTable() {
+    std::map<string, string>::iterator it;
+    for (it = entries.begin(); it != entries.end(); it++)
+      releaseEncoding(it->second);
+  }
+  // Takes over the references of value, also if the region is not locked.
   int put(string &key, string &value) {
     int result = 0;
-    if (!tx_begin()) return -1;
+    if (!tx_begin()) {
+      releaseEncoding(value);
+      return -1;
+    }
     if (entries.count(key)) {
+      releaseEncoding(entries[key]);
       entries[key] = value;
     } else {
       entries.insert(pair<string, string>(key, value));
@@ -343,6 +549,7 @@ public:
     if (!tx_begin()) return -1;
     if (entries.count(key)) {
       value = entries[key];
+      acquireEncoding(value);
       result = 1;
     }
     tx_end();
@@ -362,11 +569,19 @@ private:
   vector<string> entries;
 public:
   TxList() : Transactional(), entries() { }
-  virtual ~TxList() { }
+  virtual ~TxList() {
+    for (size_t i = 0; i < entries.size(); i++)
+      releaseEncoding(entries[i]);
+  }
+  // Takes over the references of value, also if the region is not locked.
   int put(size_t index, string &value) {
     int result = -1;
-    if (!tx_begin()) return -1;
+    if (!tx_begin()) {
+      releaseEncoding(value);
+      return -1;
+    }
     if (index >= 1 && index <= entries.size()) {
+      releaseEncoding(entries[index-1]);
       entries[index-1] = value;
       result = 1;
     } else {
@@ -382,8 +597,10 @@ public:
     if (!tx_begin()) return -1;
     if (index >= 1 && index <= entries.size()) {
       result = (entries[index-1].size() != 0);
-      if (result)
+      if (result) {
         value = entries[index-1];
+        acquireEncoding(value);
+      }
     }
     tx_end();
     return result;
@@ -397,6 +614,11 @@ public:
   }
 };
 
+// Encode the live results of the current worker thread; called before it
+// blocks waiting for other jobs or on a channel, syncvar, or stream, as it
+// cannot serve requests for them while blocked.
+static void flushWorkerResults();
+
 class SingularChannel : public SharedObject {
 private:
   queue<string> q;
@@ -404,7 +626,12 @@ private:
   ConditionVariable cond;
 public:
   SingularChannel(): SharedObject(), lock(), cond(&lock) { }
-  virtual ~SingularChannel() { }
+  virtual ~SingularChannel() {
+    while (!q.empty()) {
+      releaseEncoding(q.front());
+      q.pop();
+    }
+  }
   void send(string item) {
     lock.lock();
     q.push(item);
@@ -413,6 +640,11 @@ public:
   }
   string receive() {
     lock.lock();
+    if (q.empty()) {
+      lock.unlock();
+      flushWorkerResults();
+      lock.lock();
+    }
     while (q.empty()) {
       cond.wait();
     }
@@ -439,14 +671,20 @@ private:
   ConditionVariable cond;
 public:
   SingularSyncVar(): SharedObject(), init(0), lock(), cond(&lock) { }
-  virtual ~SingularSyncVar() { }
+  virtual ~SingularSyncVar() { releaseEncoding(value); }
   void acquire() {
     lock.lock();
   }
   void release() {
     lock.unlock();
   }
+  // Must be called with the lock held.
   void wait_init() {
+    if (!init) {
+      lock.unlock();
+      flushWorkerResults();
+      lock.lock();
+    }
     while (!init)
       cond.wait();
   }
@@ -455,6 +693,7 @@ public:
     return LinTree::from_string(value);
   }
   void update(leftv val) {
+    releaseEncoding(value);
     value = LinTree::to_string(val);
     init = 1;
     cond.broadcast();
@@ -473,9 +712,9 @@ public:
   }
   string read() {
     lock.lock();
-    while (!init)
-      cond.wait();
+    wait_init();
     string result = value;
+    acquireEncoding(result);
     lock.unlock();
     return result;
   }
@@ -649,6 +888,10 @@ char *shared_string(blackbox *b, void *d) {
     } else
       sprintf(buf, "<trigger @%p>", obj);
     return omStrDup(buf);
+  }
+  else if (type == type_jobgroup) {
+    sprintf(buf, "<jobgroup @%p>", obj);
+    return omStrDup(buf);
   } else {
     sprintf(buf, "<unknown type %d>", type);
     return omStrDup(buf);
@@ -749,17 +992,51 @@ static void appendArgCopy(vector<leftv> &argv, leftv arg) {
 }
 
 
+// Resolved procedure handles of a worker thread, by name, along with the
+// procedure generation of the worker that they were resolved in. Only
+// worker threads of thread pools have one. The generation is bumped
+// whenever the worker runs code that may define, redefine, or kill
+// procedures, i.e. for threadPoolExec() and the library loading built on
+// it; handles of an older generation are resolved again. Jobs must not
+// kill procedures that are called by name on their pool.
+struct ProcHandle {
+  idhdl handle;
+  long generation;
+};
+typedef map<string, ProcHandle> ProcCache;
+static SIMPLE_THREAD_VAR ProcCache *procCacheRef;
+static SIMPLE_THREAD_VAR long procGeneration;
+
 static BOOLEAN executeProc(sleftv &result,
   const char *procname, const vector<leftv> &argv)
 {
   leftv procnode = (leftv) omAlloc0Bin(sleftv_bin);
-  procnode->name = omStrDup(procname);
-  procnode->req_packhdl = basePack;
-  int error = procnode->Eval();
-  if (error) {
-    Werror("procedure \"%s\" not found", procname);
-    omFreeBin(procnode, sleftv_bin);
-    return TRUE;
+  ProcCache *cache = procCacheRef;
+  ProcCache::iterator it;
+  int error;
+  idhdl h = NULL;
+  if (cache && (it = cache->find(procname)) != cache->end()
+      && it->second.generation == procGeneration)
+    h = it->second.handle;
+  if (h) {
+    procnode->rtyp = IDHDL;
+    procnode->data = (char *) h;
+    procnode->name = IDID(h);
+  } else {
+    procnode->name = omStrDup(procname);
+    procnode->req_packhdl = basePack;
+    error = procnode->Eval();
+    if (error) {
+      Werror("procedure \"%s\" not found", procname);
+      omFreeBin(procnode, sleftv_bin);
+      return TRUE;
+    }
+    if (cache && procnode->rtyp == IDHDL &&
+        IDTYP((idhdl) procnode->data) == PROC_CMD) {
+      ProcHandle &entry = (*cache)[procname];
+      entry.handle = (idhdl) procnode->data;
+      entry.generation = procGeneration;
+    }
   }
   memset(&result, 0, sizeof(result));
   leftv *tail = &procnode->next;
@@ -893,6 +1170,38 @@ BOOLEAN findSharedObject(leftv result, leftv arg) {
   return FALSE;
 }
 
+static const char *sharedTypeName(int type) {
+  if (type == type_channel)
+    return "channel";
+  else if (type == type_atomic_table)
+    return "atomic_table";
+  else if (type == type_shared_table)
+    return "shared_table";
+  else if (type == type_atomic_list)
+    return "atomic_list";
+  else if (type == type_shared_list)
+    return "shared_list";
+  else if (type == type_syncvar)
+    return "syncvar";
+  else if (type == type_region)
+    return "region";
+  else if (type == type_regionlock)
+    return "regionlock";
+  else if (type == type_thread)
+    return "thread";
+  else if (type == type_threadpool)
+    return "threadpool";
+  else if (type == type_job)
+    return "job";
+  else if (type == type_trigger)
+    return "trigger";
+  else if (type == type_jobgroup)
+    return "jobgroup";
+  else if (type == 0)
+    return "internal";
+  return "undefined";
+}
+
 BOOLEAN typeSharedObject(leftv result, leftv arg) {
   if (wrong_num_args("findSharedObject", arg, 1))
     return TRUE;
@@ -902,28 +1211,47 @@ BOOLEAN typeSharedObject(leftv result, leftv arg) {
   SharedObject *obj = findSharedObject(global_objects,
     &global_objects_lock, uri);
   int type = obj ? obj->get_type() : -1;
-  const char *type_name = "undefined";
-  if (type == type_channel)
-    type_name = "channel";
-  else if (type == type_atomic_table)
-    type_name = "atomic_table";
-  else if (type == type_shared_table)
-    type_name = "shared_table";
-  else if (type == type_atomic_list)
-    type_name = "atomic_list";
-  else if (type == type_shared_list)
-    type_name = "shared_list";
-  else if (type == type_syncvar)
-    type_name = "syncvar";
-  else if (type == type_region)
-    type_name = "region";
-  else if (type == type_regionlock)
-    type_name = "regionlock";
   result->rtyp = STRING_CMD;
-  result->data = (char *)(omStrDup(type_name));
+  result->data = (char *)(omStrDup(sharedTypeName(type)));
   return FALSE;
 }
 
+BOOLEAN sharedObjectStats(leftv result, leftv arg) {
+  Command cmd("sharedObjectStats", result, arg);
+  cmd.check_argc(0);
+  if (cmd.ok()) {
+    // Objects that only wait to be reclaimed are not counted; deleting
+    // one can retire others, so reclaim until no more progress is made.
+    long last = -1;
+    int stalled = 0;
+    while (retired_count > 0 && stalled < 2) {
+      reclaimShared();
+      stalled = retired_count == last ? stalled + 1 : 0;
+      last = retired_count;
+    }
+    vector<pair<int, long> > counts;
+    for (int i = 0; i <= MAX_SHARED_TYPES; i++) {
+      long n = live_objects[i].load(std::memory_order_relaxed);
+      if (n > 0)
+        counts.push_back(make_pair(i > 0 ? MAX_TOK + i : 0, n));
+    }
+    lists l = (lists) omAlloc0Bin(slists_bin);
+    l->Init(counts.size());
+    for (int i = 0; i < counts.size(); i++) {
+      lists entry = (lists) omAlloc0Bin(slists_bin);
+      entry->Init(2);
+      entry->m[0].rtyp = STRING_CMD;
+      entry->m[0].data = (char *)(omStrDup(sharedTypeName(counts[i].first)));
+      entry->m[1].rtyp = INT_CMD;
+      entry->m[1].data = (char *)(counts[i].second);
+      l->m[i].rtyp = LIST_CMD;
+      l->m[i].data = (char *)entry;
+    }
+    cmd.set_result(LIST_CMD, l);
+  }
+  return cmd.status();
+}
+
 BOOLEAN bindSharedObject(leftv result, leftv arg) {
   if (wrong_num_args("bindSharedObject", arg, 1))
     return TRUE;
@@ -969,6 +1297,7 @@ BOOLEAN getTable(leftv result, leftv arg) {
     return TRUE;
   }
   leftv tmp = LinTree::from_string(value);
+  releaseEncoding(value);
   result->rtyp = tmp->Typ();
   result->data = tmp->Data();
   return FALSE;
@@ -1056,6 +1385,7 @@ BOOLEAN getList(leftv result, leftv arg) {
     return TRUE;
   }
   leftv tmp = LinTree::from_string(value);
+  releaseEncoding(value);
   result->rtyp = tmp->Typ();
   result->data = tmp->Data();
   return FALSE;
@@ -1166,6 +1496,7 @@ BOOLEAN receiveChannel(leftv result, leftv arg) {
   }
   string item = channel->receive();
   leftv val = LinTree::from_string(item);
+  releaseEncoding(item);
   result->rtyp = val->Typ();
   result->data = val->Data();
   return FALSE;
@@ -1201,7 +1532,9 @@ BOOLEAN writeSyncVar(leftv result, leftv arg) {
     WerrorS("writeSyncVar: syncvar has not been initialized");
     return TRUE;
   }
-  if (!syncvar->write(LinTree::to_string(arg->next))) {
+  string item = LinTree::to_string(arg->next);
+  if (!syncvar->write(item)) {
+    releaseEncoding(item);
     WerrorS("writeSyncVar: variable already has a value");
     return TRUE;
   }
@@ -1252,6 +1585,7 @@ BOOLEAN readSyncVar(leftv result, leftv arg) {
   }
   string item = syncvar->read();
   leftv val = LinTree::from_string(item);
+  releaseEncoding(item);
   result->rtyp = val->Typ();
   result->data = val->Data();
   return FALSE;
@@ -1277,8 +1611,8 @@ BOOLEAN statSyncVar(leftv result, leftv arg) {
 
 void encode_shared(LinTree::LinTree &lintree, leftv val) {
   SharedObject *obj = *(SharedObject **)(val->Data());
-  acquireShared(obj);
   lintree.put(obj);
+  lintree.put_ref(val->Typ(), obj);
 }
 
 leftv decode_shared(LinTree::LinTree &lintree) {
@@ -1290,20 +1624,23 @@ leftv decode_shared(LinTree::LinTree &lintree) {
   return result;
 }
 
-void ref_shared(LinTree::LinTree &lintree, int by) {
-  SharedObject *obj = lintree.get<SharedObject *>();
-  while (by > 0) {
-    obj->incref();
-    by--;
-  }
-  while (by < 0) {
-    obj->decref();
-    by++;
+void objref_shared(void *p, int by) {
+  SharedObject *obj = (SharedObject *) p;
+  if (by > 0)
+    obj->incref(by);
+  else {
+    for (; by < 0; by++)
+      releaseShared(obj);
   }
 }
 
+void ref_shared(LinTree::LinTree &lintree, int by) {
+  objref_shared(lintree.get<SharedObject *>(), by);
+}
+
 void installShared(int type) {
   LinTree::install(type, encode_shared, decode_shared, ref_shared);
+  LinTree::install_objref(type, objref_shared);
 }
 
 void makeSharedType(int &type, const char *name) {
@@ -1414,10 +1751,13 @@ void *interpreter_thread(ThreadState *ts, void *arg) {
     expr = ts->to_thread.front();
     /* this will implicitly eval commands */
     leftv val = LinTree::from_string(expr);
+    releaseEncoding(expr);
     expr = LinTree::to_string(val);
     ts->to_thread.pop();
     if (eval)
       ts->from_thread.push(expr);
+    else
+      releaseEncoding(expr);
     ts->from_cond.signal();
   }
   ts->lock.unlock();
@@ -1547,30 +1887,177 @@ static BOOLEAN joinThread(leftv result, leftv arg) {
 
 class ThreadPool;
 class Trigger;
+class JobGroup;
+
+// Lets a thread wait for a number of jobs to finish; registered with
+// all of the jobs, which notify it once they are done.
+class JobWaiter {
+public:
+  Lock lock;
+  ConditionVariable cond;
+  long needed;
+  long finished;
+  JobWaiter(long needed_init) : lock(), cond(&lock),
+    needed(needed_init), finished(0) { }
+  void notify() {
+    lock.lock();
+    if (++finished == needed)
+      cond.signal();
+    lock.unlock();
+  }
+};
+
+// Encoded arguments bound by a job template; shared by all jobs created
+// from the template and never modified once shared. They extend the
+// bound arguments of the template's own template, if any, so that no
+// arguments are ever copied between templates.
+class JobArgs : public SharedObject {
+public:
+  JobArgs *prefix; // precedes args, may be NULL
+  vector<string> args;
+  JobArgs(JobArgs *prefix_init) : SharedObject(), prefix(prefix_init),
+    args() {
+    if (prefix) acquireShared(prefix);
+  }
+  ~JobArgs() {
+    if (prefix) releaseShared(prefix);
+    releaseEncodings(args);
+  }
+  void collect(vector<string *> &parts) {
+    if (prefix) prefix->collect(parts);
+    for (int i = 0; i < args.size(); i++)
+      parts.push_back(&args[i]);
+  }
+};
+
+// A bounded stream of encoded values that a running job emits and that
+// other threads consume with jobNext() while it is still running. It is
+// closed when the job finishes. Dependencies do not read streams.
+class JobStream {
+private:
+  Lock lock;
+  ConditionVariable not_empty;
+  ConditionVariable not_full;
+  queue<string> items;
+  long capacity;
+  bool closed;
+  bool cancelled;
+  // False if the producer runs in the thread of its consumer, which
+  // only reads the stream once the producer has finished.
+  bool bounded;
+public:
+  JobStream(bool bounded_init) : lock(), not_empty(&lock), not_full(&lock),
+    items(), capacity(256), closed(false), cancelled(false),
+    bounded(bounded_init) { }
+  ~JobStream() {
+    while (!items.empty()) {
+      releaseEncoding(items.front());
+      items.pop();
+    }
+  }
+  void setCapacity(long n) {
+    lock.lock();
+    capacity = n;
+    not_full.broadcast();
+    lock.unlock();
+  }
+  // Blocks while the stream is full; values emitted by a cancelled job
+  // are dropped. Takes over the references of value.
+  void emit(string value);
+  void close() {
+    lock.lock();
+    closed = true;
+    not_empty.broadcast();
+    lock.unlock();
+  }
+  void cancel() {
+    lock.lock();
+    cancelled = true;
+    not_full.broadcast();
+    lock.unlock();
+  }
+  // Wait for the next value; false if the stream has been closed and
+  // all values have been consumed.
+  bool next(string &value, bool remove);
+};
+
+// Invoked by the thread that finished a job, without the scheduler
+// lock held.
+class JobCallback {
+public:
+  virtual ~JobCallback() { }
+  virtual void run(Job *job) = 0;
+};
 
+// References to a job are owned by:
+// - its creator: the interpreter value or kernel caller it was
+//   returned to; builtins that create a job hold one until the job
+//   has been handed out, as it may finish before;
+// - the jobs it depends on, one per entry in their notify lists, until
+//   they have notified or cancelled their dependents (releaseNotify);
+// - the scheduler, one taken when the job is enqueued or admitted to
+//   run inline, or one per worker for broadcast jobs. It is held while
+//   the job is pending, queued, or running and dropped exactly once by
+//   whoever takes the job out: the worker that ran it (also if it was
+//   cancelled while queued), runJobInline(), dispatchCached() when the
+//   result was cached, cancelJob() when the job was still pending,
+//   updateTrigger() when it fires a trigger itself, or the scheduler's
+//   destructor;
+// - its job group until it has finished, and the jobs that depend on
+//   it (deps) and threads waiting for it for as long as they do.
 class Job : public SharedObject {
 public:
   ThreadPool *pool;
+  JobGroup *group;
+  long group_index;
   long prio;
   size_t id;
   long pending_index;
   vector<Job *> deps;
-  vector<Job *> notify;
+  vector<Job *> notify; // dependents still to be notified
   vector<Trigger *> triggers;
+  vector<JobWaiter *> waiters;
+  vector<JobCallback *> callbacks;
+  JobStream *stream; // created on demand
+  JobArgs *bound_args; // precede args, may be NULL
+  JobArgs *frozen_args; // copy of all arguments while the job runs
   vector<string> args;
   string result; // lintree-encoded
+  // Result not yet encoded, only valid in the thread of the worker that
+  // produced it; result is empty while this is set.
+  leftv live_result;
   void *data;
+  long mem_estimate; // expected peak memory use in bytes
+  int affinity; // worker that must run the job, or -1
+  int worker; // worker that ran the job, or -1
   bool fast;
   bool done;
   bool queued;
   bool running;
   bool cancelled;
-  Job() : SharedObject(), pool(NULL), deps(), pending_index(-1), fast(false),
-    done(false), running(false), queued(false), cancelled(false), data(NULL),
-    result(), args(), notify(), triggers(), prio(0)
+  bool keep_live; // result may be kept as a live value
+  bool cache_checked; // the result caches have been searched
+  bool encode_requested; // another thread needs the live result encoded
+  bool broadcast; // run by every worker, which all need the arguments
+  bool result_once; // drop the result once its consumers have read it
+  // Dependents and waiting threads that have yet to read the result;
+  // each is counted under the scheduler lock when it registers, and
+  // only counted ones call consumeResult().
+  long readers;
+  bool result_consumed; // a consume-once result has been dropped
+  Job() : SharedObject(), pool(NULL), group(NULL), group_index(-1),
+    prio(0), pending_index(-1), deps(), notify(), triggers(),
+    stream(NULL), bound_args(NULL), frozen_args(NULL), args(), result(),
+    live_result(NULL), data(NULL), mem_estimate(0), affinity(-1), worker(-1), fast(false),
+    done(false), queued(false), running(false), cancelled(false),
+    keep_live(false), cache_checked(false), encode_requested(false),
+    broadcast(false), result_once(false), readers(0),
+    result_consumed(false)
   { set_type(type_job); }
   ~Job();
+  void setPool(ThreadPool *pool_init);
   void addDep(Job *job) {
+    acquireShared(job);
     deps.push_back(job);
   }
   void addDep(vector<Job *> &jobs);
@@ -1578,8 +2065,20 @@ public:
   void addNotify(vector<Job *> &jobs);
   void addNotify(Job *job);
   virtual bool ready();
+  virtual bool depsCancelled();
   virtual void execute() = 0;
+  // A new, unscheduled job of the same kind, or NULL if the job cannot
+  // serve as a template.
+  virtual Job *instantiate() { return NULL; }
+  // Identifies what the job computes for the purpose of caching its
+  // result; false if the result must not be cached.
+  virtual bool cacheKey(string &key) { return false; }
+  void collectArgs(vector<leftv> &argv);
+  JobArgs *freezeArgs();
+  void setResult(sleftv &val);
+  void consumeResult();
   void run();
+  void setDone();
 };
 
 struct JobCompare {
@@ -1612,26 +2111,373 @@ bool Job::ready() {
   return true;
 }
 
+// Whether the job must be cancelled because of cancelled dependencies.
+bool Job::depsCancelled() {
+  vector<Job *>::iterator it;
+  for (it = deps.begin(); it != deps.end(); it++) {
+    if ((*it)->cancelled) return true;
+  }
+  return false;
+}
+
 Job::~Job() {
   vector<Job *>::iterator it;
   for (it = deps.begin(); it != deps.end(); it++) {
     releaseShared(*it);
   }
+  for (int i = 0; i < notify.size(); i++)
+    releaseShared(notify[i]);
+  for (int i = 0; i < triggers.size(); i++)
+    releaseShared(triggers[i]);
+  if (group)
+    releaseShared((SharedObject *) group);
+  if (pool)
+    releaseShared((SharedObject *) pool);
+  if (bound_args)
+    releaseShared(bound_args);
+  if (frozen_args)
+    releaseShared(frozen_args);
+  releaseEncodings(args);
+  releaseEncoding(result);
+  if (live_result) {
+    live_result->CleanUp();
+    omFreeBin(live_result, sleftv_bin);
+  }
+  for (int i = 0; i < callbacks.size(); i++)
+    delete callbacks[i];
+  delete stream;
+}
+
+// Store the result of executing the job; takes ownership of val.
+void Job::setResult(sleftv &val) {
+  if (keep_live) {
+    live_result = (leftv) omAlloc0Bin(sleftv_bin);
+    memcpy(live_result, &val, sizeof(val));
+  } else {
+    result = LinTree::to_string(&val);
+    val.CleanUp();
+  }
+}
+
+// The result of a job as a value owned by the caller, or NULL if there
+// is none. A live result may only be accessed by the worker that
+// produced it.
+static leftv resultValue(Job *job) {
+  if (job->live_result) {
+    leftv val = (leftv) omAlloc0Bin(sleftv_bin);
+    val->Copy(job->live_result);
+    return val;
+  }
+  if (job->result.size() == 0)
+    return NULL;
+  return LinTree::from_string(job->result);
+}
+
+// Arguments for execution: bound arguments, then the job's own
+// arguments, then the results of its dependencies.
+void Job::collectArgs(vector<leftv> &argv) {
+  if (bound_args) {
+    vector<string *> bound;
+    bound_args->collect(bound);
+    for (int i = 0; i < bound.size(); i++) {
+      appendArg(argv, *bound[i]);
+    }
+  }
+  for (int i = 0; i < args.size(); i++) {
+    appendArg(argv, args[i]);
+  }
+  for (int i = 0; i < deps.size(); i++) {
+    if (deps[i]->live_result)
+      appendArgCopy(argv, deps[i]->live_result);
+    else
+      appendArg(argv, deps[i]->result);
+  }
+}
+
+class ProcCallback : public JobCallback {
+private:
+  string procname;
+public:
+  ProcCallback(const char *p) : procname(p) { }
+  virtual void run(Job *job) {
+    vector<leftv> argv;
+    leftv arg = resultValue(job);
+    if (arg)
+      argv.push_back(arg);
+    sleftv val;
+    int error = executeProc(val, procname.c_str(), argv);
+    if (!error)
+      val.CleanUp();
+  }
+};
+
+class KernelCallback : public JobCallback {
+private:
+  void (*cfunc)(Job *job, void *data);
+  void *data;
+public:
+  KernelCallback(void (*func)(Job *job, void *data), void *data_init) :
+    cfunc(func), data(data_init) { }
+  virtual void run(Job *job) {
+    cfunc(job, data);
+  }
+};
+
+// Protects the structure of all job groups: membership, subgroups,
+// counts, and cancellation. May be acquired while holding a scheduler
+// lock, but not the other way round.
+static Lock group_lock;
+
+class JobGroup : public SharedObject {
+public:
+  JobGroup *parent;
+  vector<JobGroup *> children;
+  vector<Job *> jobs; // unfinished jobs of this group
+  long outstanding; // unfinished jobs of this group and its subgroups
+  long unthreaded; // those of them on pools without worker threads
+  bool cancelled;
+  ConditionVariable cond;
+  JobGroup(JobGroup *parent_init) : SharedObject(), parent(parent_init),
+    children(), jobs(), outstanding(0), unthreaded(0), cancelled(false),
+    cond(&group_lock)
+  {
+    set_type(type_jobgroup);
+    if (parent) {
+      acquireShared(parent);
+      group_lock.lock();
+      parent->children.push_back(this);
+      cancelled = parent->cancelled;
+      group_lock.unlock();
+    }
+  }
+  virtual ~JobGroup() {
+    if (parent) {
+      group_lock.lock();
+      vector<JobGroup *> &siblings = parent->children;
+      siblings.erase(std::find(siblings.begin(), siblings.end(), this));
+      group_lock.unlock();
+      releaseShared(parent);
+    }
+  }
+  // The following must be called with group_lock held.
+  void addJob(Job *job);
+  void removeJob(Job *job);
+  // Mark this group and its subgroups as cancelled and collect their
+  // unfinished jobs.
+  void cancel(vector<Job *> &victims) {
+    cancelled = true;
+    for (int i = 0; i < jobs.size(); i++) {
+      acquireShared(jobs[i]);
+      victims.push_back(jobs[i]);
+    }
+    for (int i = 0; i < children.size(); i++)
+      children[i]->cancel(victims);
+  }
+  // An unfinished job of this group or a subgroup that runs on a pool
+  // without worker threads, or NULL.
+  Job *unthreadedJob();
+};
+
+static SIMPLE_THREAD_VAR JobGroup *currentJobGroupRef;
+
+// Record that a consumer has read the result. A consume-once result is
+// dropped after all registered readers, its dependents and the threads
+// waiting for it, have read it or, if there are none, after it has been
+// retrieved once. Must be called with the scheduler lock held.
+void Job::consumeResult() {
+  if (readers > 0)
+    readers--;
+  if (!result_once || readers > 0)
+    return;
+  releaseEncoding(result);
+  string().swap(result);
+  result_consumed = true;
+}
+
+// Called exactly once per job, when it has finished or was cancelled
+// before it could run.
+void Job::setDone() {
+  if (done)
+    return;
+  done = true;
+  for (int i = 0; i < deps.size(); i++)
+    deps[i]->consumeResult();
+  if (stream)
+    stream->close();
+  for (int i = 0; i < waiters.size(); i++)
+    waiters[i]->notify();
+  if (group_index >= 0) {
+    group_lock.lock();
+    group->removeJob(this);
+    group_lock.unlock();
+  }
+}
+
+// Add a job that is about to be scheduled to the current job group.
+static void joinCurrentGroup(Job *job) {
+  JobGroup *group = currentJobGroupRef;
+  if (group && !job->group && job->get_type() != type_trigger) {
+    group_lock.lock();
+    group->addJob(job);
+    group_lock.unlock();
+  }
 }
 
 typedef queue<Job *> JobQueue;
+typedef priority_queue<Job *, vector<Job *>, JobCompare> JobPrioQueue;
 
 class Scheduler;
 
+// Parking slot for an idle worker thread.
+struct WorkerSlot {
+  ConditionVariable cond;
+  bool parked;
+  WorkerSlot(Lock *lock) : cond(lock), parked(false) { }
+};
+
 struct SchedInfo {
   Scheduler *scheduler;
   Job *job;
   int num;
 };
 
+// Resident set size of the process in bytes, or zero if it cannot
+// be determined.
+static long processMemoryUsage() {
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp) return 0;
+  long size, resident;
+  int n = fscanf(fp, "%ld %ld", &size, &resident);
+  fclose(fp);
+  if (n != 2) return 0;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Outcomes of admission control for new jobs.
+enum {
+  AdmitQueue,
+  AdmitInline,
+  AdmitReject
+};
+
+// How long (in milliseconds) a worker waits before checking again
+// whether memory has dropped below the pool's limit.
+#define MEMORY_POLL_INTERVAL 20
+
+// processMemoryUsage(), read at most once per MEMORY_POLL_INTERVAL, as
+// schedulers consult it whenever they dequeue a job.
+static long sampledMemoryUsage() {
+  static std::atomic<long> usage(0);
+  static std::atomic<long> sampled(0); // in milliseconds
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  long now = tv.tv_sec * 1000L + tv.tv_usec / 1000;
+  long last = sampled.load(std::memory_order_relaxed);
+  if (now - last >= MEMORY_POLL_INTERVAL
+      && sampled.compare_exchange_strong(last, now))
+    usage.store(processMemoryUsage(), std::memory_order_relaxed);
+  return usage.load(std::memory_order_relaxed);
+}
+
+// Upper bound for the number of pause instructions between two polls
+// of an idle worker; beyond that, spinning workers yield the CPU.
+#define MAX_SPIN_BACKOFF 64
+
+static inline void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#endif
+}
+
 static SIMPLE_THREAD_VAR ThreadPool *currentThreadPoolRef;
 static SIMPLE_THREAD_VAR Job *currentJobRef;
 
+// A process-wide budget of cores that the workers of all thread pools
+// draw from. A worker holds a core while it is running jobs and returns
+// it when it runs out of work. When pools compete for cores, each pool
+// is entitled to a share proportional to its weight. A limit of zero
+// disables the budget.
+class CoreBudget {
+private:
+  Lock lock;
+  ConditionVariable cond;
+  std::atomic<long> limit;
+  long used;
+  long active_weight; // sum of weights of pools using or wanting cores
+  vector<Scheduler *> waiting; // pools with workers waiting for a core
+  long fairShare(Scheduler *sched);
+  bool mayAcquire(Scheduler *sched);
+  void update(Scheduler *sched, long used_delta, long waiting_delta);
+public:
+  CoreBudget() : lock(), cond(&lock), limit(0), used(0),
+    active_weight(0), waiting() { }
+  bool limited() { return limit.load(std::memory_order_relaxed) > 0; }
+  void setLimit(long cores);
+  void setWeight(Scheduler *sched, long weight);
+  bool acquire(Scheduler *sched);
+  void release(Scheduler *sched);
+  void wakeAll();
+};
+
+static CoreBudget core_budget;
+
+// The scheduler on whose behalf the current thread holds a core, if any.
+static SIMPLE_THREAD_VAR Scheduler *coreHolderRef;
+
+// Return the core held by the current thread, if any, and the scheduler
+// it was held for. A thread that blocks waiting for jobs lends its core
+// this way, so that nested pools can run even when the budget is used up.
+static Scheduler *releaseCore() {
+  Scheduler *sched = coreHolderRef;
+  if (sched) {
+    core_budget.release(sched);
+    coreHolderRef = NULL;
+  }
+  return sched;
+}
+
+// Acquire a core for sched; must not be called with a scheduler lock held.
+// Does not acquire one if sched is shutting down.
+static void reclaimCore(Scheduler *sched) {
+  if (sched && core_budget.acquire(sched))
+    coreHolderRef = sched;
+}
+
+// Lends the core of the current thread while it blocks on condition
+// variables; it is returned before the first wait and must be taken
+// back with reclaim() once the thread no longer holds the lock.
+class CoreLender {
+private:
+  Scheduler *holder;
+  bool lent;
+public:
+  CoreLender() : holder(NULL), lent(false) { }
+  void wait(ConditionVariable &cond) {
+    if (!lent) {
+      holder = releaseCore();
+      lent = true;
+    }
+    cond.wait();
+  }
+  bool lending() { return lent; }
+  void reclaim() {
+    reclaimCore(holder);
+    holder = NULL;
+    lent = false;
+  }
+};
+
+// Wait until the jobs registered with waiter have finished.
+static void awaitJobs(JobWaiter &waiter) {
+  CoreLender lender;
+  flushWorkerResults();
+  waiter.lock.lock();
+  while (waiter.finished < waiter.needed)
+    lender.wait(waiter.cond);
+  waiter.lock.unlock();
+  lender.reclaim();
+}
+
 class ThreadPool : public SharedObject {
 public:
   Scheduler *scheduler;
@@ -1642,7 +2488,7 @@ public:
   ThreadState *getThread(int i);
   void shutdown(bool wait);
   void addThread(ThreadState *thread);
-  void attachJob(Job *job);
+  int attachJob(Job *job);
   void detachJob(Job *job);
   void queueJob(Job *job);
   void broadcastJob(Job *job);
@@ -1653,40 +2499,344 @@ public:
 };
 
 
-class Scheduler : public SharedObject {
+static inline unsigned long fnv1a(const string &s) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < s.size(); i++) {
+    hash ^= (unsigned char) s[i];
+    hash *= 1099511628211ULL;
+  }
+  return (unsigned long) hash;
+}
+
+// Encoded job results by cache key, with LRU eviction. Keys are looked
+// up by hash and then compared in full.
+class ResultCache {
 private:
-  bool single_threaded;
-  size_t jobid;
-  int nthreads;
-  bool shutting_down;
-  int shutdown_counter;
+  struct Entry {
+    unsigned long hash;
+    string key;
+    string result;
+  };
+  typedef list<Entry> EntryList;
+  Lock lock;
+  EntryList entries; // most recently used first
+  unordered_map<unsigned long, EntryList::iterator> index;
+  std::atomic<long> capacity; // zero if disabled
+  long max_bytes; // zero if unbounded
+  long bytes; // size of all keys and results
+  long hits, misses;
+  // Must be called with the lock held.
+  void evict() {
+    while (entries.size() > capacity || (max_bytes > 0 && bytes > max_bytes)) {
+      Entry &entry = entries.back();
+      bytes -= entry.key.size() + entry.result.size();
+      index.erase(entry.hash);
+      entries.pop_back();
+    }
+  }
+public:
+  ResultCache() : lock(), entries(), index(), capacity(0), max_bytes(0),
+    bytes(0), hits(0), misses(0) { }
+  bool enabled() { return capacity.load(std::memory_order_relaxed) > 0; }
+  void setCapacity(long n, long max_bytes_init) {
+    lock.lock();
+    capacity = n;
+    max_bytes = max_bytes_init;
+    evict();
+    lock.unlock();
+  }
+  // Forget all results, as the functions that computed them may have
+  // changed.
+  void clear() {
+    lock.lock();
+    entries.clear();
+    index.clear();
+    bytes = 0;
+    lock.unlock();
+  }
+  bool lookup(const string &key, string &result) {
+    unsigned long hash = fnv1a(key);
+    bool found = false;
+    lock.lock();
+    unordered_map<unsigned long, EntryList::iterator>::iterator it =
+      index.find(hash);
+    if (it != index.end() && it->second->key == key) {
+      entries.splice(entries.begin(), entries, it->second);
+      result = it->second->result;
+      found = true;
+      hits++;
+    } else {
+      misses++;
+    }
+    lock.unlock();
+    return found;
+  }
+  void insert(const string &key, const string &result) {
+    unsigned long hash = fnv1a(key);
+    lock.lock();
+    if (capacity > 0) {
+      unordered_map<unsigned long, EntryList::iterator>::iterator it =
+        index.find(hash);
+      if (it != index.end()) {
+        // same key or a hash collision; either way, replace the entry
+        bytes -= it->second->key.size() + it->second->result.size();
+        entries.erase(it->second);
+        index.erase(it);
+      }
+      Entry entry = { hash, key, result };
+      entries.push_front(entry);
+      index[hash] = entries.begin();
+      bytes += key.size() + result.size();
+      evict();
+    }
+    lock.unlock();
+  }
+  void stats(long &hits_out, long &misses_out, long &entries_out,
+      long &bytes_out) {
+    lock.lock();
+    hits_out = hits;
+    misses_out = misses;
+    entries_out = entries.size();
+    bytes_out = bytes;
+    lock.unlock();
+  }
+};
+
+// Encoded job results stored as files in a directory, so that they
+// survive the process. Each file holds the length of the key, the key,
+// and the result; file names are derived from a hash of the key and a
+// version string. Files are written under a temporary name and renamed
+// into place, and the least recently used files are removed when the
+// directory grows beyond its size limit.
+class DiskCache {
+private:
+  Lock lock;
+  string dir; // empty if disabled
+  string version;
+  long max_bytes;
+  long total_bytes; // approximately
+  std::atomic<bool> active;
+  std::atomic<long> tmp_counter;
+  string path(const string &key) {
+    char buf[32];
+    lock.lock();
+    string hashed = version;
+    string result = dir;
+    lock.unlock();
+    hashed.push_back('\0');
+    hashed.append(key);
+    sprintf(buf, "/%016lx.res", fnv1a(hashed));
+    result.append(buf);
+    return result;
+  }
+  // Remove the least recently used files until at most 90% of the
+  // limit is in use. Must be called with the lock held.
+  void evict() {
+    DIR *d = opendir(dir.c_str());
+    if (!d) return;
+    vector<pair<time_t, string> > files;
+    long total = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+      string name = ent->d_name;
+      if (name.size() < 4 || name.compare(name.size() - 4, 4, ".res") != 0)
+        continue;
+      string file = dir + "/" + name;
+      struct stat st;
+      if (stat(file.c_str(), &st) != 0)
+        continue;
+      total += st.st_size;
+      files.push_back(make_pair(st.st_mtime, file));
+    }
+    closedir(d);
+    std::sort(files.begin(), files.end());
+    long target = max_bytes / 10 * 9;
+    for (int i = 0; i < files.size() && total > target; i++) {
+      struct stat st;
+      if (stat(files[i].second.c_str(), &st) == 0 &&
+          unlink(files[i].second.c_str()) == 0)
+        total -= st.st_size;
+    }
+    total_bytes = total;
+  }
+public:
+  DiskCache() : lock(), dir(), version(), max_bytes(0), total_bytes(0),
+    active(false), tmp_counter(0) { }
+  bool enabled() { return active.load(std::memory_order_relaxed); }
+  bool configure(const char *dir_init, long max_bytes_init,
+      const char *version_init) {
+    lock.lock();
+    active = false;
+    dir = dir_init;
+    version = version_init;
+    max_bytes = max_bytes_init;
+    bool ok = true;
+    if (dir.size() > 0) {
+      if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+        ok = false;
+      else {
+        total_bytes = max_bytes + 1;
+        evict(); // also computes total_bytes
+        active = true;
+      }
+    }
+    lock.unlock();
+    return ok;
+  }
+  bool lookup(const string &key, string &result) {
+    string file = path(key);
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    bool found = false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(unsigned long long)) {
+      size_t size = st.st_size;
+      void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        const char *p = (const char *) map;
+        unsigned long long keylen;
+        memcpy(&keylen, p, sizeof(keylen));
+        size_t offset = sizeof(keylen);
+        if (keylen == key.size() && size - offset >= keylen &&
+            memcmp(p + offset, key.data(), keylen) == 0) {
+          offset += keylen;
+          result.assign(p + offset, size - offset);
+          found = true;
+        }
+        munmap(map, size);
+      }
+    }
+    close(fd);
+    if (found)
+      utimes(file.c_str(), NULL); // for eviction order
+    return found;
+  }
+  void insert(const string &key, const string &result) {
+    string file = path(key);
+    char buf[64];
+    sprintf(buf, ".%ld.%ld.tmp", (long) getpid(), tmp_counter++);
+    string tmp = file + buf;
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+      return;
+    unsigned long long keylen = key.size();
+    string data((const char *) &keylen, sizeof(keylen));
+    data.append(key);
+    data.append(result);
+    const char *p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+      ssize_t n = write(fd, p, left);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      p += n;
+      left -= n;
+    }
+    close(fd);
+    if (left > 0 || rename(tmp.c_str(), file.c_str()) != 0) {
+      unlink(tmp.c_str());
+      return;
+    }
+    lock.lock();
+    total_bytes += data.size();
+    if (total_bytes > max_bytes)
+      evict();
+    lock.unlock();
+  }
+};
+
+class Scheduler : public SharedObject {
+private:
+  bool single_threaded;
+  size_t jobid;
+  int nthreads;
+  bool shutting_down;
+  int shutdown_counter;
   vector<ThreadState *> threads;
-  priority_queue<Job *, vector<Job *>, JobCompare> global_queue;
-  vector<JobQueue *> thread_queues;
+  JobPrioQueue global_queue;
+  // per worker: broadcast jobs and jobs with an affinity
+  vector<JobPrioQueue *> thread_queues;
+  vector<JobQueue *> local_queues; // preferred, but stealable jobs
+  long local_jobs; // total number of jobs in local_queues
   vector<Job *> pending;
-  ConditionVariable cond;
+  vector<WorkerSlot *> slots;
+  vector<int> idle_workers; // stack of parked workers
   ConditionVariable response;
+  ConditionVariable not_full;
+  long queue_limit; // zero if unbounded
+  QueuePolicy queue_policy;
+  long mem_limit; // in bytes, zero if unlimited
+  long mem_reserved; // sum of estimates of running jobs
+  long mem_baseline; // memory usage when no job was running
+  int running_jobs;
+  long spin_limit; // polls before an idle worker parks
+  int spinning; // number of workers currently spinning
+  std::atomic<long> work_counter; // bumped whenever work is queued
+  vector<vector<Job *> > live_jobs; // per worker: unencoded results
+  vector<bool> encode_wanted; // per worker: encoding has been requested
+  // Core budget bookkeeping, protected by the budget's lock.
+  long weight;
+  long cores_used;
+  long cores_waiting;
+  friend class CoreBudget;
 public:
   Lock lock;
+  ResultCache cache; // results of proc jobs, if enabled
+  DiskCache disk_cache;
   Scheduler(int n) :
-    SharedObject(), threads(), global_queue(), thread_queues(),
-    single_threaded(n==0), nthreads(n == 0 ? 1 : n),
-    lock(true), cond(&lock), response(&lock),
-    shutting_down(false), shutdown_counter(0), jobid(0)
+    SharedObject(), single_threaded(n==0), jobid(0),
+    nthreads(n == 0 ? 1 : n), shutting_down(false), shutdown_counter(0),
+    threads(), global_queue(), thread_queues(), local_queues(),
+    local_jobs(0), slots(), idle_workers(),
+    response(&lock), not_full(&lock),
+    queue_limit(0), queue_policy(QueueBlock),
+    mem_limit(0), mem_reserved(0), mem_baseline(0), running_jobs(0),
+    spin_limit(0), spinning(0), work_counter(0),
+    weight(1), cores_used(0), cores_waiting(0),
+    lock(true)
   {
-    thread_queues.push_back(new JobQueue());
+    thread_queues.push_back(new JobPrioQueue());
+    for (int i = 0; i < nthreads; i++) {
+      slots.push_back(new WorkerSlot(&lock));
+      local_queues.push_back(new JobQueue());
+    }
+    live_jobs.resize(nthreads);
+    encode_wanted.resize(nthreads);
   }
   virtual ~Scheduler() {
+    while (!global_queue.empty()) {
+      releaseShared(global_queue.top());
+      global_queue.pop();
+    }
+    for (int i = 0; i < pending.size(); i++)
+      releaseShared(pending[i]);
+    pending.clear();
     for (int i = 0; i < thread_queues.size(); i++) {
-      JobQueue *q = thread_queues[i];
+      JobPrioQueue *q = thread_queues[i];
       while (!q->empty()) {
-        Job *job = q->front();
+        Job *job = q->top();
 	q->pop();
 	releaseShared(job);
       }
     }
     thread_queues.clear();
+    for (int i = 0; i < local_queues.size(); i++) {
+      JobQueue *q = local_queues[i];
+      while (!q->empty()) {
+        Job *job = q->front();
+	q->pop();
+	releaseShared(job);
+      }
+      delete q;
+    }
+    local_queues.clear();
     threads.clear();
+    for (int i = 0; i < slots.size(); i++)
+      delete slots[i];
+    slots.clear();
   }
   ThreadState *getThread(int i) { return threads[i]; }
   void shutdown(bool wait) {
@@ -1699,83 +2849,605 @@ public:
       Scheduler::main(NULL, info);
       return;
     }
+    // The workers may need the core of a worker of another pool that
+    // shuts this one down in order to finish.
+    CoreLender lender;
     lock.lock();
     if (wait) {
-      while (!global_queue.empty()) {
-        response.wait();
+      while (!global_queue.empty() || local_jobs > 0) {
+        lender.wait(response);
       }
     }
     shutting_down = true;
+    work_counter++;
+    core_budget.wakeAll();
     while (shutdown_counter < nthreads) {
-      cond.broadcast();
-      response.wait();
+      unparkAllWorkers();
+      lender.wait(response);
     }
     lock.unlock();
     for (int i = 0; i <threads.size(); i++) {
       joinThread(threads[i]);
     }
+    lender.reclaim();
   }
   void addThread(ThreadState *thread) {
     threads.push_back(thread);
-    thread_queues.push_back(new JobQueue());
+    thread_queues.push_back(new JobPrioQueue());
+  }
+  long queueLength() {
+    return global_queue.size() + local_jobs + pending.size();
+  }
+  void setQueueLimit(long limit, QueuePolicy policy) {
+    lock.lock();
+    queue_limit = limit;
+    queue_policy = policy;
+    not_full.broadcast();
+    lock.unlock();
+  }
+  // Decide whether n new jobs may be queued. Must be called with the
+  // lock held. Blocking is not an option when called from one of our
+  // own workers (or for a pool without threads), as no other thread
+  // might be left to drain the queue; such callers run the job inline
+  // if possible or exceed the limit otherwise.
+  int admitJobs(long n, bool can_inline) {
+    bool own_thread = single_threaded ||
+      (currentJobRef && currentJobRef->pool &&
+       currentJobRef->pool->scheduler == this);
+    CoreLender lender;
+    for (;;) {
+      int admit = AdmitQueue;
+      while (queue_limit > 0 && queueLength() + n > queue_limit) {
+        if (queue_policy == QueueFail) {
+          admit = AdmitReject;
+          break;
+        }
+        if (can_inline && (queue_policy == QueueInline || own_thread)) {
+          admit = AdmitInline;
+          break;
+        }
+        if (own_thread)
+          break;
+        lender.wait(not_full);
+      }
+      if (!lender.lending())
+        return admit;
+      // Taking the core back requires releasing the lock, during which
+      // the queue may fill up again.
+      lock.unlock();
+      lender.reclaim();
+      lock.lock();
+    }
+  }
+  void jobDequeued() {
+    if (queue_limit > 0 && queueLength() < queue_limit)
+      not_full.broadcast();
+  }
+  // Whether a new job would be rejected right now. It may still be
+  // rejected later if the queue fills up in the meantime.
+  bool queueFull() {
+    lock.lock();
+    bool full = queue_policy == QueueFail && queue_limit > 0
+      && queueLength() >= queue_limit;
+    lock.unlock();
+    return full;
   }
-  void attachJob(ThreadPool *pool, Job *job) {
+  // Queue a job, or keep it pending until its dependencies are done.
+  // A job is only ever queued once; later attempts are ignored.
+  void enqueueJob(ThreadPool *pool, Job *job) {
     lock.lock();
-    job->pool = pool;
+    if (job->queued || job->pending_index >= 0) {
+      lock.unlock();
+      return;
+    }
+    job->setPool(pool);
     job->id = jobid++;
     acquireShared(job);
+    joinCurrentGroup(job);
     if (job->ready()) {
-      global_queue.push(job);
-      cond.signal();
+      job->queued = true;
+      pushJob(job);
     }
     else if (job->pending_index < 0) {
-      job->pool = pool;
+      job->setPool(pool);
       job->pending_index = pending.size();
       pending.push_back(job);
     }
     lock.unlock();
   }
+  int attachJob(ThreadPool *pool, Job *job) {
+    if (job->queued || job->pending_index >= 0)
+      return AdmitQueue;
+    if (job->fast) {
+      enqueueJob(pool, job);
+      return AdmitQueue;
+    }
+    if (cachesEnabled() && job->ready()) {
+      string key, result;
+      if (job->cacheKey(key)) {
+        if (lookupCached(key, result)) {
+          completeCached(pool, job, result);
+          return AdmitQueue;
+        }
+        job->cache_checked = true;
+      }
+    }
+    lock.lock();
+    int admit = admitJobs(1, job->ready() && job->affinity < 0);
+    if (admit == AdmitInline) {
+      job->setPool(pool);
+      job->id = jobid++;
+      job->queued = true;
+      acquireShared(job);
+      joinCurrentGroup(job);
+    } else if (admit == AdmitQueue) {
+      enqueueJob(pool, job);
+    }
+    lock.unlock();
+    return admit;
+  }
+  bool cachesEnabled() {
+    return cache.enabled() || disk_cache.enabled();
+  }
+  // Look up a result in memory, then on disk. Must be called without
+  // holding the lock.
+  bool lookupCached(const string &key, string &result) {
+    if (cache.enabled() && cache.lookup(key, result))
+      return true;
+    if (disk_cache.enabled() && disk_cache.lookup(key, result)) {
+      if (cache.enabled())
+        cache.insert(key, result);
+      return true;
+    }
+    return false;
+  }
+  // Look up the results of ready dependents of a job finished by
+  // worker producer in the result caches; complete those that are found
+  // there and queue the others. Must be called with the lock held once.
+  void dispatchCached(vector<Job *> &jobs, int producer) {
+    vector<string> keys(jobs.size());
+    vector<string> results(jobs.size());
+    vector<bool> hits(jobs.size());
+    for (int i = 0; i < jobs.size(); i++) {
+      if (!jobs[i]->cacheKey(keys[i]))
+        keys[i].clear();
+    }
+    lock.unlock();
+    for (int i = 0; i < jobs.size(); i++) {
+      hits[i] = keys[i].size() > 0 && lookupCached(keys[i], results[i]);
+    }
+    lock.lock();
+    for (int i = 0; i < jobs.size(); i++) {
+      Job *job = jobs[i];
+      if (job->done) // cancelled in the meantime
+        continue;
+      job->cache_checked = true;
+      if (hits[i]) {
+        detachJob(job);
+        jobDequeued();
+        job->result.swap(results[i]);
+        job->setDone();
+        notifyDeps(this, job);
+        releaseShared(job);
+      } else {
+        queueDependent(job, producer);
+      }
+    }
+    response.broadcast();
+  }
+  // Complete a job that has not been queued with a result from a
+  // result cache. Must be called without holding the lock.
+  void completeCached(ThreadPool *pool, Job *job, string &result) {
+    lock.lock();
+    job->setPool(pool);
+    job->id = jobid++;
+    job->queued = true;
+    joinCurrentGroup(job);
+    job->result.swap(result);
+    job->setDone();
+    notifyDeps(this, job);
+    response.broadcast();
+    lock.unlock();
+  }
+  // Execute a job that was admitted with AdmitInline in the calling
+  // thread. Must be called without holding the lock.
+  void runJobInline(Job *job) {
+    lock.lock();
+    Job *oldJob = currentJobRef;
+    currentJobRef = job;
+    job->run();
+    currentJobRef = oldJob;
+    notifyDeps(this, job);
+    response.broadcast();
+    lock.unlock();
+    releaseShared(job);
+  }
   void detachJob(Job *job) {
     lock.lock();
     long i = job->pending_index;
     job->pending_index = -1;
     if (i >= 0) {
-      job = pending.back();
-      pending.resize(pending.size()-1);
-      pending[i] = job;
-      job->pending_index = i;
+      Job *last = pending.back();
+      pending.pop_back();
+      if (last != job) {
+        pending[i] = last;
+        last->pending_index = i;
+      }
     }
     lock.unlock();
   }
+  // Must be called with the lock held after work has been queued.
+  // Spinning workers notice new work by themselves, so we only need
+  // to wake up a parked worker if none are spinning.
+  void wakeWorker() {
+    work_counter++;
+    if (spinning == 0)
+      unparkWorker();
+  }
+  // Park worker num until another thread wakes it up or, if timeout
+  // is positive, until timeout milliseconds have passed. Must be
+  // called with the lock held.
+  void parkWorker(int num, long timeout = 0) {
+    WorkerSlot *slot = slots[num];
+    slot->parked = true;
+    idle_workers.push_back(num);
+    if (timeout > 0)
+      slot->cond.timed_wait(timeout);
+    else {
+      while (slot->parked)
+        slot->cond.wait();
+    }
+    if (slot->parked)
+      unparkWorker(num);
+  }
+  // Wake up the most recently parked worker, whose caches are most
+  // likely to still be warm. Returns false if no worker was parked.
+  bool unparkWorker() {
+    if (idle_workers.empty())
+      return false;
+    int num = idle_workers.back();
+    idle_workers.pop_back();
+    slots[num]->parked = false;
+    slots[num]->cond.signal();
+    return true;
+  }
+  bool unparkWorker(int num) {
+    if (!slots[num]->parked)
+      return false;
+    for (int i = idle_workers.size() - 1; i >= 0; i--) {
+      if (idle_workers[i] == num) {
+        idle_workers.erase(idle_workers.begin() + i);
+        break;
+      }
+    }
+    slots[num]->parked = false;
+    slots[num]->cond.signal();
+    return true;
+  }
+  void unparkAllWorkers() {
+    while (unparkWorker()) { }
+  }
+  int numWorkers() {
+    return nthreads;
+  }
+  // True if some worker is looking for work, i.e. if splitting off
+  // a job would put another thread to use.
+  bool hasIdleWorkers() {
+    lock.lock();
+    bool result = !idle_workers.empty() || spinning > 0;
+    lock.unlock();
+    return result;
+  }
+  // Queue a job that is ready to run. Jobs with an affinity go to
+  // the queue of their worker, all others to the global queue. Must
+  // be called with the lock held.
+  void pushJob(Job *job) {
+    if (job->affinity >= 0) {
+      thread_queues[job->affinity]->push(job);
+      work_counter++;
+      unparkWorker(job->affinity);
+    } else {
+      global_queue.push(job);
+      wakeWorker();
+    }
+  }
+  void setSpinLimit(long spins) {
+    lock.lock();
+    spin_limit = spins;
+    lock.unlock();
+  }
+  // Poll for new work with exponential backoff for up to spin_limit
+  // iterations before the caller parks. Must be called with the lock
+  // held; the lock is released while spinning.
+  void spinForWork() {
+    long seen = work_counter.load(std::memory_order_acquire);
+    long limit = spin_limit; // read under the lock
+    long backoff = 1;
+    spinning++;
+    lock.unlock();
+    for (long i = 0; i < limit; i++) {
+      if (backoff <= MAX_SPIN_BACKOFF) {
+        for (long j = 0; j < backoff; j++)
+          cpuRelax();
+        backoff *= 2;
+      } else {
+        sched_yield();
+      }
+      if (work_counter.load(std::memory_order_acquire) != seen)
+        break;
+    }
+    lock.lock();
+    spinning--;
+  }
+  // Queue a pending job that has become ready by other means than its
+  // dependencies finishing, i.e. a trigger. Its queue reference is the
+  // one taken when it was enqueued.
   void queueJob(Job *job) {
     lock.lock();
-    global_queue.push(job);
-    cond.signal();
+    if (!job->queued && !job->done) {
+      detachJob(job);
+      job->queued = true;
+      pushJob(job);
+    }
+    lock.unlock();
+  }
+  // The worker that produced the largest input of a job, or -1 if
+  // there is no such worker.
+  int preferredWorker(Job *job) {
+    int result = -1;
+    size_t largest = 0;
+    for (int i = 0; i < job->deps.size(); i++) {
+      Job *dep = job->deps[i];
+      // A live result is worth more than any encoded one, as it does
+      // not even have to be encoded if it is consumed locally.
+      size_t size = dep->live_result ? (size_t) -1 : dep->result.size();
+      if (dep->worker >= 0 && dep->pool == job->pool && size >= largest) {
+        result = dep->worker;
+        largest = size;
+      }
+    }
+    return result;
+  }
+  // The worker that runs the current job if it belongs to this pool,
+  // or -1.
+  int currentWorker() {
+    Job *job = currentJobRef;
+    if (job && job->pool && job->pool->scheduler == this)
+      return job->worker;
+    return -1;
+  }
+  // Whether job depends on live results of workers other than num.
+  bool needsForeignResults(Job *job, int num) {
+    for (int i = 0; i < job->deps.size(); i++) {
+      Job *dep = job->deps[i];
+      if (dep->live_result && dep->worker != num)
+        return true;
+    }
+    return false;
+  }
+  // Ask the workers holding live inputs of job to encode them, so that
+  // worker num can take the job. Must be called with the lock held.
+  void requestEncoding(Job *job, int num) {
+    for (int i = 0; i < job->deps.size(); i++) {
+      Job *dep = job->deps[i];
+      if (dep->live_result && dep->worker != num && !dep->encode_requested) {
+        dep->encode_requested = true;
+        encode_wanted[dep->worker] = true;
+        work_counter++;
+        unparkWorker(dep->worker);
+      }
+    }
+  }
+  // Record a live result produced by worker num.
+  void addLiveResult(int num, Job *job) {
+    acquireShared(job);
+    live_jobs[num].push_back(job);
+  }
+  // Encode the live results of worker num, all of them or just those
+  // that other threads asked for. Must be called by that worker with
+  // the lock held once.
+  void encodeLiveResults(int num, bool requested_only) {
+    vector<Job *> &live = live_jobs[num];
+    vector<Job *> todo, keep;
+    encode_wanted[num] = false;
+    for (int i = 0; i < live.size(); i++) {
+      if (!requested_only || live[i]->encode_requested)
+        todo.push_back(live[i]);
+      else
+        keep.push_back(live[i]);
+    }
+    if (todo.empty())
+      return;
+    live.swap(keep);
+    // Only this worker touches live results, so encoding them does not
+    // require the lock.
     lock.unlock();
+    vector<string> encoded(todo.size());
+    for (int i = 0; i < todo.size(); i++) {
+      leftv val = todo[i]->live_result;
+      encoded[i] = LinTree::to_string(val);
+      val->CleanUp();
+      omFreeBin(val, sleftv_bin);
+    }
+    lock.lock();
+    for (int i = 0; i < todo.size(); i++) {
+      todo[i]->result.swap(encoded[i]);
+      todo[i]->live_result = NULL;
+      todo[i]->encode_requested = false;
+      releaseShared(todo[i]);
+    }
+    response.broadcast();
+    // Other workers can take the jobs queued here now; this worker
+    // takes one of them itself.
+    JobQueue *q = local_queues[num];
+    for (size_t i = 1; i < q->size() && unparkWorker(); i++) { }
+  }
+  void flushLiveResults(int num) {
+    lock.lock();
+    if (!live_jobs[num].empty())
+      encodeLiveResults(num, false);
+    lock.unlock();
+  }
+  // Make sure that the result of job is encoded. If it is live on
+  // another worker, ask that worker to encode it and wait. The caller
+  // is worker self (or -1 if it is not a worker of this pool) and must
+  // hold the lock.
+  void ensureEncoded(Job *job, int self) {
+    while (job->live_result) {
+      int owner = job->worker;
+      job->encode_requested = true;
+      encode_wanted[owner] = true;
+      if (owner == self) {
+        encodeLiveResults(self, true);
+        continue;
+      }
+      work_counter++;
+      unparkWorker(owner);
+      // Serve requests for our own live results while waiting, or two
+      // workers waiting for each other would deadlock.
+      if (self >= 0 && encode_wanted[self])
+        encodeLiveResults(self, true);
+      else
+        response.wait();
+    }
+  }
+  // Make sure that all inputs of a job that worker num is about to run
+  // are available to it.
+  void ensureResults(Job *job, int num) {
+    for (int i = 0; i < job->deps.size(); i++) {
+      Job *dep = job->deps[i];
+      if (dep->live_result && dep->worker != num)
+        ensureEncoded(dep, num);
+    }
+  }
+  void fetchResult(Job *job) {
+    lock.lock();
+    ensureEncoded(job, currentWorker());
+    lock.unlock();
+  }
+  // Queue a dependent job that has just become ready on the worker
+  // that produced the largest of its inputs, so that the data is
+  // likely to still be in that worker's caches. Other workers only
+  // take such jobs when they run out of work. Producer is the worker
+  // that completed the last dependency, if any.
+  void queueDependent(Job *job, int producer) {
+    lock.lock();
+    detachJob(job);
+    int num = -1;
+    if (!single_threaded && job->affinity < 0)
+      num = preferredWorker(job);
+    if (num < 0)
+      pushJob(job);
+    else {
+      JobQueue *q = local_queues[num];
+      q->push(job);
+      local_jobs++;
+      work_counter++;
+      // The producer picks up its own first job on its next iteration
+      // anyway; for other work, a worker needs to be woken up.
+      if (!unparkWorker(num) && (num != producer || q->size() > 1)
+          && spinning == 0)
+        unparkWorker();
+    }
+    lock.unlock();
+  }
+  bool isSingleThreaded() {
+    return single_threaded;
+  }
+  bool hasWork(int num) {
+    return !local_queues[num]->empty() || !global_queue.empty() ||
+      local_jobs > 0;
+  }
+  void setWeight(long w) {
+    core_budget.setWeight(this, w);
+  }
+  // Select the next job for worker num: its own local jobs come
+  // first, then the global queue, then local jobs of other workers.
+  // Returns NULL if no job is available or if the memory limit does
+  // not allow for starting the next job; in the latter case, blocked
+  // is set.
+  Job *takeJob(int num, bool &blocked) {
+    JobQueue *source = NULL;
+    Job *job = NULL;
+    if (!local_queues[num]->empty())
+      source = local_queues[num];
+    else if (!global_queue.empty())
+      job = global_queue.top();
+    else if (local_jobs > 0) {
+      for (int i = 1; i < nthreads; i++) {
+        JobQueue *q = local_queues[(num + i) % nthreads];
+        if (q->empty())
+          continue;
+        // Jobs that need live results of another worker can only be
+        // taken once that worker has encoded them.
+        if (needsForeignResults(q->front(), num))
+          requestEncoding(q->front(), num);
+        else {
+          source = q;
+          break;
+        }
+      }
+    }
+    if (source)
+      job = source->front();
+    if (!job)
+      return NULL;
+    if (!memoryAvailable(job)) {
+      blocked = true;
+      return NULL;
+    }
+    if (source) {
+      source->pop();
+      local_jobs--;
+    } else
+      global_queue.pop();
+    jobDequeued();
+    return job;
   }
   void broadcastJob(Job *job) {
     lock.lock();
-    for (int i = 0; i <thread_queues.size(); i++) {
+    job->broadcast = true;
+    job->id = jobid++;
+    // Only the first nthreads queues belong to worker threads.
+    for (int i = 0; i < nthreads; i++) {
       acquireShared(job);
       thread_queues[i]->push(job);
     }
+    work_counter++;
+    unparkAllWorkers();
     lock.unlock();
   }
   void cancelDeps(Job * job) {
     vector<Job *> &notify = job->notify;
     for (int i = 0; i <notify.size(); i++) {
       Job *next = notify[i];
-      if (!next->cancelled) {
+      if (!next->cancelled && next->depsCancelled()) {
         cancelJob(next);
       }
     }
+    releaseNotify(job);
+  }
+  // Drop the references to the dependents of a job once they have been
+  // notified or cancelled.
+  static void releaseNotify(Job *job) {
+    vector<Job *> notify;
+    notify.swap(job->notify);
+    for (int i = 0; i < notify.size(); i++)
+      releaseShared(notify[i]);
   }
   void cancelJob(Job *job) {
     lock.lock();
     if (!job->cancelled) {
       job->cancelled = true;
+      if (job->stream)
+        job->stream->cancel();
       if (!job->running && !job->done) {
-        job->done = true;
+        job->setDone();
+        if (job->pending_index >= 0) {
+          detachJob(job);
+          jobDequeued();
+          releaseShared(job); // the reference taken by enqueueJob
+        }
 	cancelDeps(job);
       }
     }
@@ -1790,34 +3462,66 @@ public:
       info->job = job;
       Scheduler::main(NULL, info);
     } else {
+      CoreLender lender;
+      flushWorkerResults();
       lock.lock();
-      for (;;) {
-	if (job->done || job->cancelled) {
-	  break;
-	}
-	response.wait();
-      }
+      while (!job->done && !job->cancelled)
+        lender.wait(response);
       response.signal(); // forward signal
       lock.unlock();
+      lender.reclaim();
     }
   }
   void clearThreadState() {
     threads.clear();
   }
+  void setMemoryLimit(long limit) {
+    lock.lock();
+    mem_limit = limit;
+    unparkAllWorkers();
+    lock.unlock();
+  }
+  // Can job be started without exceeding the memory limit? At least
+  // one job is always allowed to run so that the pool makes progress.
+  // The measured usage already contains what running jobs have
+  // allocated so far, so their estimates are only added to the usage
+  // measured while none was running.
+  bool memoryAvailable(Job *job) {
+    if (mem_limit == 0 || job->fast || job->broadcast)
+      return true;
+    long usage = sampledMemoryUsage();
+    if (running_jobs == 0) {
+      mem_baseline = usage;
+      return true;
+    }
+    long projected = std::max(usage, mem_baseline + mem_reserved);
+    return projected + job->mem_estimate <= mem_limit;
+  }
   static void notifyDeps(Scheduler *scheduler, Job *job) {
+    EpochGuard guard;
     vector<Job *> &notify = job->notify;
-    job->incref(notify.size());
+    vector<Job *> lookups;
     for (int i = 0; i <notify.size(); i++) {
       Job *next = notify[i];
+      // Dependents that have not been enqueued yet are queued by
+      // enqueueJob() once they are, if they are ready by then.
+      if (!next->pool)
+        continue;
       if (!next->queued && next->ready() && !next->cancelled) {
         next->queued = true;
-        scheduler->queueJob(next);
+        if (scheduler->cachesEnabled())
+          lookups.push_back(next);
+        else
+          scheduler->queueDependent(next, job->worker);
       }
     }
+    if (!lookups.empty())
+      scheduler->dispatchCached(lookups, job->worker);
+    releaseNotify(job);
     vector<Trigger *> &triggers = job->triggers;
     leftv arg = NULL;
-    if (triggers.size() > 0 && job->result.size() > 0)
-      arg = LinTree::from_string(job->result);
+    if (triggers.size() > 0)
+      arg = resultValue(job);
     for (int i = 0; i < triggers.size(); i++) {
       Trigger *trigger = triggers[i];
       if (trigger->accept(arg)) {
@@ -1830,6 +3534,18 @@ public:
       arg->CleanUp();
       omFreeBin(arg, sleftv_bin);
     }
+    if (job->callbacks.size() > 0) {
+      vector<JobCallback *> callbacks;
+      callbacks.swap(job->callbacks);
+      if (!job->cancelled) {
+        scheduler->lock.unlock();
+        for (int i = 0; i < callbacks.size(); i++)
+          callbacks[i]->run(job);
+        scheduler->lock.lock();
+      }
+      for (int i = 0; i < callbacks.size(); i++)
+        delete callbacks[i];
+    }
   }
   static void *main(ThreadState *ts, void *arg) {
     SchedInfo *info = (SchedInfo *) arg;
@@ -1838,11 +3554,13 @@ public:
     // TODO: set current thread pool
     // currentThreadPoolRef = pool;
     Lock &lock = scheduler->lock;
-    ConditionVariable &cond = scheduler->cond;
     ConditionVariable &response = scheduler->response;
-    JobQueue *my_queue = scheduler->thread_queues[info->num];
-    if (!scheduler->single_threaded)
+    JobPrioQueue *my_queue = scheduler->thread_queues[info->num];
+    if (!scheduler->single_threaded) {
       thread_init();
+      procCacheRef = new ProcCache();
+    }
+    bool spun = false;
     lock.lock();
     for (;;) {
       if (info->job && info->job->done)
@@ -1852,47 +3570,292 @@ public:
         scheduler->response.signal();
 	break;
       }
+      if (scheduler->encode_wanted[info->num])
+        scheduler->encodeLiveResults(info->num, true);
+      bool blocked = false;
+      Job *job = NULL;
+      // All jobs, including broadcast and affinity jobs, need a core.
+      if (!scheduler->single_threaded && !coreHolderRef
+          && core_budget.limited()
+          && (!my_queue->empty() || scheduler->hasWork(info->num))) {
+        lock.unlock();
+        reclaimCore(scheduler);
+        lock.lock();
+        continue;
+      }
       if (!my_queue->empty()) {
-       Job *job = my_queue->front();
-       my_queue->pop();
-       if (!scheduler->global_queue.empty())
-         cond.signal();
-       currentJobRef = job;
-       job->run();
-       currentJobRef = NULL;
-       notifyDeps(scheduler, job);
-       releaseShared(job);
-       scheduler->response.signal();
-       continue;
-      } else if (!scheduler->global_queue.empty()) {
-       Job *job = scheduler->global_queue.top();
-       scheduler->global_queue.pop();
+        // Broadcast jobs and jobs with an affinity for this worker.
+        if (scheduler->memoryAvailable(my_queue->top())) {
+          job = my_queue->top();
+          my_queue->pop();
+        } else
+          blocked = true;
+      } else
+        job = scheduler->takeJob(info->num, blocked);
+      if (job) {
        if (!scheduler->global_queue.empty())
-         cond.signal();
+         scheduler->unparkWorker();
+       scheduler->running_jobs++;
+       scheduler->mem_reserved += job->mem_estimate;
+       job->worker = info->num;
+       scheduler->ensureResults(job, info->num);
+       job->keep_live = !scheduler->single_threaded && job->notify.size() > 0
+         && !scheduler->cache.enabled() && !scheduler->disk_cache.enabled()
+         && !job->result_once;
        currentJobRef = job;
        job->run();
        currentJobRef = NULL;
+       if (job->live_result)
+         scheduler->addLiveResult(info->num, job);
+       scheduler->running_jobs--;
+       scheduler->mem_reserved -= job->mem_estimate;
+       if (scheduler->mem_limit && !scheduler->global_queue.empty())
+         scheduler->unparkWorker();
        notifyDeps(scheduler, job);
        releaseShared(job);
+       // Only one of several dependents queued here can use the live
+       // results; encode them now so that other workers can take the
+       // rest instead of waiting for this worker to run them in turn.
+       if (scheduler->local_queues[info->num]->size() > 1
+           && !scheduler->live_jobs[info->num].empty())
+         scheduler->encodeLiveResults(info->num, false);
        scheduler->response.signal();
+       spun = false;
+       if (reclaimDue()) {
+         lock.unlock();
+         reclaimShared();
+         lock.lock();
+       }
        continue;
+      } else if (blocked) {
+        if (!scheduler->live_jobs[info->num].empty())
+          scheduler->encodeLiveResults(info->num, false);
+        if (coreHolderRef == scheduler)
+          releaseCore();
+        scheduler->parkWorker(info->num, MEMORY_POLL_INTERVAL);
       } else {
         if (scheduler->single_threaded) {
           break;
         }
-        cond.wait();
+        // Nobody can ask an idle worker to encode its results.
+        if (!scheduler->live_jobs[info->num].empty()) {
+          scheduler->encodeLiveResults(info->num, false);
+          continue;
+        }
+        if (coreHolderRef == scheduler)
+          releaseCore();
+        if (scheduler->spin_limit > 0 && !spun) {
+          scheduler->spinForWork();
+          spun = true;
+          continue;
+        }
+        spun = false;
+        scheduler->parkWorker(info->num);
       }
     }
+    if (!scheduler->live_jobs[info->num].empty())
+      scheduler->encodeLiveResults(info->num, false);
+    if (coreHolderRef == scheduler)
+      releaseCore();
+    if (!scheduler->single_threaded) {
+      delete procCacheRef;
+      procCacheRef = NULL;
+    }
     // TODO: correct current thread pool
     // releaseShared(currentThreadPoolRef);
     currentThreadPoolRef = oldThreadPool;
     scheduler->lock.unlock();
     delete info;
+    // Each worker, and each call from waitJob() or shutdown() for pools
+    // without threads, was handed a reference to the scheduler.
+    releaseShared(scheduler);
     return NULL;
   }
 };
 
-ThreadPool::ThreadPool(int n) : SharedObject(), nthreads(n), poolid(0) {
+void CoreBudget::update(Scheduler *sched, long used_delta,
+    long waiting_delta) {
+  bool was_active = sched->cores_used + sched->cores_waiting > 0;
+  sched->cores_used += used_delta;
+  sched->cores_waiting += waiting_delta;
+  used += used_delta;
+  bool is_active = sched->cores_used + sched->cores_waiting > 0;
+  if (is_active && !was_active)
+    active_weight += sched->weight;
+  else if (was_active && !is_active)
+    active_weight -= sched->weight;
+  if (waiting_delta > 0 && sched->cores_waiting == waiting_delta)
+    waiting.push_back(sched);
+  else if (waiting_delta < 0 && sched->cores_waiting == 0) {
+    for (int i = 0; i < waiting.size(); i++) {
+      if (waiting[i] == sched) {
+        waiting[i] = waiting.back();
+        waiting.pop_back();
+        break;
+      }
+    }
+  }
+}
+
+long CoreBudget::fairShare(Scheduler *sched) {
+  long cores = limit;
+  long share = active_weight ? cores * sched->weight / active_weight : cores;
+  return share > 0 ? share : 1;
+}
+
+bool CoreBudget::mayAcquire(Scheduler *sched) {
+  long cores = limit;
+  if (cores <= 0)
+    return true;
+  if (used >= cores)
+    return false;
+  if (sched->cores_used < fairShare(sched))
+    return true;
+  // Above our share: leave the core to a pool that is still below its
+  // share, but do not let it go unused otherwise.
+  for (int i = 0; i < waiting.size(); i++) {
+    Scheduler *other = waiting[i];
+    if (other != sched && other->cores_used < fairShare(other))
+      return false;
+  }
+  return true;
+}
+
+void CoreBudget::setLimit(long cores) {
+  lock.lock();
+  limit = cores;
+  cond.broadcast();
+  lock.unlock();
+}
+
+void CoreBudget::setWeight(Scheduler *sched, long weight) {
+  lock.lock();
+  if (sched->cores_used + sched->cores_waiting > 0)
+    active_weight += weight - sched->weight;
+  sched->weight = weight;
+  cond.broadcast();
+  lock.unlock();
+}
+
+// Returns false without a core if sched is shut down while waiting.
+bool CoreBudget::acquire(Scheduler *sched) {
+  lock.lock();
+  update(sched, 0, 1);
+  while (!mayAcquire(sched) && !sched->shutting_down)
+    cond.wait();
+  bool acquired = mayAcquire(sched);
+  update(sched, acquired ? 1 : 0, -1);
+  lock.unlock();
+  return acquired;
+}
+
+// Make waiting threads check again whether their pool is shutting down.
+void CoreBudget::wakeAll() {
+  lock.lock();
+  cond.broadcast();
+  lock.unlock();
+}
+
+void CoreBudget::release(Scheduler *sched) {
+  lock.lock();
+  update(sched, -1, 0);
+  if (!waiting.empty())
+    cond.broadcast();
+  lock.unlock();
+}
+
+void JobStream::emit(string value) {
+  CoreLender lender;
+  lock.lock();
+  if (bounded && items.size() >= capacity && !cancelled) {
+    lock.unlock();
+    flushWorkerResults();
+    lock.lock();
+  }
+  while (bounded && items.size() >= capacity && !cancelled)
+    lender.wait(not_full);
+  if (!cancelled) {
+    items.push(string());
+    items.back().swap(value);
+    not_empty.signal();
+  }
+  lock.unlock();
+  releaseEncoding(value);
+  lender.reclaim();
+}
+
+bool JobStream::next(string &value, bool remove) {
+  CoreLender lender;
+  lock.lock();
+  if (items.empty() && !closed) {
+    lock.unlock();
+    flushWorkerResults();
+    lock.lock();
+  }
+  while (items.empty() && !closed)
+    lender.wait(not_empty);
+  bool result = !items.empty();
+  if (result && remove) {
+    value.swap(items.front());
+    items.pop();
+    not_full.signal();
+  }
+  lock.unlock();
+  lender.reclaim();
+  return result;
+}
+
+static void flushWorkerResults() {
+  Job *job = currentJobRef;
+  if (job && job->pool && job->worker >= 0)
+    job->pool->scheduler->flushLiveResults(job->worker);
+}
+
+void JobGroup::addJob(Job *job) {
+  bool threaded = !job->pool->scheduler->isSingleThreaded();
+  acquireShared(this);
+  acquireShared(job);
+  job->group = this;
+  job->group_index = jobs.size();
+  jobs.push_back(job);
+  if (cancelled)
+    job->cancelled = true;
+  for (JobGroup *g = this; g; g = g->parent) {
+    g->outstanding++;
+    if (!threaded) g->unthreaded++;
+  }
+}
+
+void JobGroup::removeJob(Job *job) {
+  bool threaded = !job->pool->scheduler->isSingleThreaded();
+  long i = job->group_index;
+  jobs[i] = jobs.back();
+  jobs[i]->group_index = i;
+  jobs.pop_back();
+  job->group_index = -1;
+  for (JobGroup *g = this; g; g = g->parent) {
+    if (!threaded) g->unthreaded--;
+    if (--g->outstanding == 0)
+      g->cond.broadcast();
+  }
+  releaseShared(job);
+}
+
+Job *JobGroup::unthreadedJob() {
+  if (unthreaded == 0)
+    return NULL;
+  for (int i = 0; i < jobs.size(); i++) {
+    if (jobs[i]->pool->scheduler->isSingleThreaded())
+      return jobs[i];
+  }
+  for (int i = 0; i < children.size(); i++) {
+    Job *job = children[i]->unthreadedJob();
+    if (job) return job;
+  }
+  return NULL;
+}
+
+ThreadPool::ThreadPool(int n) : SharedObject(), poolid(0), nthreads(n) {
   scheduler = new Scheduler(n);
   acquireShared(scheduler);
 }
@@ -1904,8 +3867,8 @@ void ThreadPool::shutdown(bool wait) { scheduler->shutdown(wait); }
 void ThreadPool::addThread(ThreadState *thread) {
   scheduler->addThread(thread);
 }
-void ThreadPool::attachJob(Job *job) {
-  scheduler->attachJob(this, job);
+int ThreadPool::attachJob(Job *job) {
+  return scheduler->attachJob(this, job);
 }
 void ThreadPool::detachJob(Job *job) {
   scheduler->detachJob(job);
@@ -1929,39 +3892,100 @@ void ThreadPool::clearThreadState() {
   scheduler->clearThreadState();
 }
 
+void Job::setPool(ThreadPool *pool_init) {
+  if (pool_init == pool)
+    return;
+  if (pool_init)
+    acquireShared(pool_init);
+  if (pool)
+    releaseShared(pool);
+  pool = pool_init;
+}
+
 void Job::addDep(vector<Job *> &jobs) {
-  deps.insert(deps.end(), jobs.begin(), jobs.end());
+  for (int i = 0; i < jobs.size(); i++)
+    addDep(jobs[i]);
 }
 
 void Job::addDep(long ndeps, Job **jobs) {
   for (long i = 0; i < ndeps; i++) {
-    deps.push_back(jobs[i]);
+    addDep(jobs[i]);
   }
 }
 
+// Dependents are referenced until they have been notified. A job that
+// has already finished has nothing left to tell them; as far as it is
+// concerned, they are ready now and get queued once they are enqueued.
+// Must be called with the scheduler lock held.
 void Job::addNotify(vector<Job *> &jobs) {
-  notify.insert(notify.end(), jobs.begin(), jobs.end());
-  if (done) {
-    Scheduler::notifyDeps(pool->scheduler, this);
-  }
+  for (int i = 0; i < jobs.size(); i++)
+    addNotify(jobs[i]);
 }
 
 void Job::addNotify(Job *job) {
+  // The dependent reads the result when it runs or is cancelled, even
+  // if the job has already finished.
+  readers++;
+  if (done)
+    return;
+  acquireShared(job);
   notify.push_back(job);
-  if (done) {
-    Scheduler::notifyDeps(pool->scheduler, this);
-  }
 }
 
 void Job::run() {
   if (!cancelled) {
     running = true;
     pool->scheduler->lock.unlock();
-    execute();
+    // The job's group becomes current with a reference of its own, as
+    // the job may replace it with setCurrentJobGroup().
+    JobGroup *oldGroup = currentJobGroupRef;
+    if (group) acquireShared(group);
+    currentJobGroupRef = group;
+    Scheduler *scheduler = pool->scheduler;
+    ResultCache &cache = scheduler->cache;
+    DiskCache &disk_cache = scheduler->disk_cache;
+    string key;
+    if (scheduler->cachesEnabled() && cacheKey(key)) {
+      // Jobs whose result was looked up when they became ready are only
+      // queued if it was not found.
+      bool hit = !cache_checked && scheduler->lookupCached(key, result);
+      if (!hit) {
+        execute();
+        if (result.size() > 0 && !holdsReferences(result)) {
+          if (cache.enabled())
+            cache.insert(key, result);
+          if (disk_cache.enabled())
+            disk_cache.insert(key, result);
+        }
+      }
+    } else {
+      execute();
+    }
+    if (currentJobGroupRef) releaseShared(currentJobGroupRef);
+    currentJobGroupRef = oldGroup;
     pool->scheduler->lock.lock();
     running = false;
+    // The arguments are only needed anymore if the job is used as a
+    // template later, which a job whose result is consumed once is not;
+    // broadcast jobs may still be running on other workers.
+    if (!broadcast) {
+      if (result_once) {
+        releaseEncodings(args);
+        vector<string>().swap(args);
+        if (bound_args) {
+          releaseShared(bound_args);
+          bound_args = NULL;
+        }
+        if (frozen_args) {
+          releaseShared(frozen_args);
+          frozen_args = NULL;
+        }
+      } else {
+        freezeArgs();
+      }
+    }
   }
-  done = true;
+  setDone();
 }
 
 class AccTrigger : public Trigger {
@@ -2031,8 +4055,8 @@ private:
   vector<bool> set;
   long count;
 public:
-  SetTrigger(long count_init) : Trigger(), count(0),
-    set(count_init) {
+  SetTrigger(long count_init) : Trigger(), set(count_init),
+    count(0) {
   }
   virtual bool ready() {
     if (!Trigger::ready()) return false;
@@ -2126,6 +4150,8 @@ static BOOLEAN createThreadPool(leftv result, leftv arg) {
       ThreadState *thread = newThread(Scheduler::main, info, &error);
       if (!thread) {
         // TODO: clean up bad pool
+        releaseShared(pool->scheduler);
+        delete info;
         return cmd.abort(error);
       }
       pool->addThread(thread);
@@ -2135,18 +4161,21 @@ static BOOLEAN createThreadPool(leftv result, leftv arg) {
   return cmd.status();
 }
 
-ThreadPool *createThreadPool(int nthreads, int prioThreads = 0) {
+ThreadPool *createThreadPool(int nthreads, int prioThreads) {
   ThreadPool *pool = new ThreadPool((int) nthreads);
   pool->set_type(type_threadpool);
+  acquireShared(pool); // owned by the caller
   for (int i = 0; i <nthreads; i++) {
     const char *error;
     SchedInfo *info = new SchedInfo();
     info->scheduler = pool->scheduler;
-    acquireShared(pool);
+    acquireShared(pool->scheduler);
     info->job = NULL;
     info->num = i;
     ThreadState *thread = newThread(Scheduler::main, info, &error);
     if (!thread) {
+      releaseShared(pool->scheduler);
+      delete info;
       return NULL;
     }
     pool->addThread(thread);
@@ -2186,6 +4215,201 @@ void closeThreadPool(ThreadPool *pool, bool wait) {
   pool->shutdown(wait);
 }
 
+static BOOLEAN setThreadPoolMemoryLimit(leftv result, leftv arg) {
+  Command cmd("setThreadPoolMemoryLimit", result, arg);
+  cmd.check_argc(2);
+  cmd.check_arg(0, type_threadpool, "first argument must be a threadpool");
+  cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(1, INT_CMD, "second argument must be an integer");
+  if (cmd.ok()) {
+    ThreadPool *pool = cmd.shared_arg<ThreadPool>(0);
+    long megabytes = cmd.int_arg(1);
+    if (megabytes < 0)
+      return cmd.abort("memory limit must be non-negative");
+    pool->scheduler->setMemoryLimit(megabytes << 20);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+void setMemoryLimit(ThreadPool *pool, long bytes) {
+  pool->scheduler->setMemoryLimit(bytes);
+}
+
+static BOOLEAN setThreadPoolQueueLimit(leftv result, leftv arg) {
+  Command cmd("setThreadPoolQueueLimit", result, arg);
+  cmd.check_argc(2, 3);
+  cmd.check_arg(0, type_threadpool, "first argument must be a threadpool");
+  cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(1, INT_CMD, "second argument must be an integer");
+  if (cmd.nargs() > 2)
+    cmd.check_arg(2, STRING_CMD, "third argument must be a string");
+  if (cmd.ok()) {
+    ThreadPool *pool = cmd.shared_arg<ThreadPool>(0);
+    long limit = cmd.int_arg(1);
+    QueuePolicy policy = QueueBlock;
+    if (limit < 0)
+      return cmd.abort("queue limit must be non-negative");
+    if (cmd.nargs() > 2) {
+      const char *kind = (const char *) cmd.arg(2);
+      if (0 == strcmp(kind, "block"))
+        policy = QueueBlock;
+      else if (0 == strcmp(kind, "fail"))
+        policy = QueueFail;
+      else if (0 == strcmp(kind, "inline"))
+        policy = QueueInline;
+      else
+        return cmd.abort("queue policy must be \"block\", \"fail\", or \"inline\"");
+    }
+    pool->scheduler->setQueueLimit(limit, policy);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+void setQueueLimit(ThreadPool *pool, long limit, QueuePolicy policy) {
+  pool->scheduler->setQueueLimit(limit, policy);
+}
+
+static BOOLEAN setThreadPoolSpin(leftv result, leftv arg) {
+  Command cmd("setThreadPoolSpin", result, arg);
+  cmd.check_argc(2);
+  cmd.check_arg(0, type_threadpool, "first argument must be a threadpool");
+  cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(1, INT_CMD, "second argument must be an integer");
+  if (cmd.ok()) {
+    ThreadPool *pool = cmd.shared_arg<ThreadPool>(0);
+    long spins = cmd.int_arg(1);
+    if (spins < 0)
+      return cmd.abort("spin count must be non-negative");
+    pool->scheduler->setSpinLimit(spins);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+void setSpinLimit(ThreadPool *pool, long spins) {
+  pool->scheduler->setSpinLimit(spins);
+}
+
+static BOOLEAN setThreadPoolCache(leftv result, leftv arg) {
+  Command cmd("setThreadPoolCache", result, arg);
+  cmd.check_argc(2, 3);
+  cmd.check_arg(0, type_threadpool, "first argument must be a threadpool");
+  cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(1, INT_CMD, "second argument must be an integer");
+  if (cmd.nargs() == 3)
+    cmd.check_arg(2, INT_CMD, "third argument must be an integer");
+  if (cmd.ok()) {
+    ThreadPool *pool = cmd.shared_arg<ThreadPool>(0);
+    long entries = cmd.int_arg(1);
+    long megabytes = cmd.nargs() == 3 ? cmd.int_arg(2) : 0;
+    if (entries < 0 || megabytes < 0)
+      return cmd.abort("cache size must be non-negative");
+    pool->scheduler->cache.setCapacity(entries, megabytes << 20);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+void setResultCache(ThreadPool *pool, long entries, long bytes) {
+  pool->scheduler->cache.setCapacity(entries, bytes);
+}
+
+static BOOLEAN setThreadPoolDiskCache(leftv result, leftv arg) {
+  Command cmd("setThreadPoolDiskCache", result, arg);
+  cmd.check_argc(3, 4);
+  cmd.check_arg(0, type_threadpool, "first argument must be a threadpool");
+  cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(1, STRING_CMD, "second argument must be a string");
+  cmd.check_arg(2, INT_CMD, "third argument must be an integer");
+  if (cmd.nargs() == 4)
+    cmd.check_arg(3, STRING_CMD, "fourth argument must be a string");
+  if (cmd.ok()) {
+    ThreadPool *pool = cmd.shared_arg<ThreadPool>(0);
+    const char *dir = (const char *) cmd.arg(1);
+    long megabytes = cmd.int_arg(2);
+    const char *version = cmd.nargs() == 4 ? (const char *) cmd.arg(3) : "";
+    if (megabytes <= 0)
+      return cmd.abort("cache size must be positive");
+    if (!pool->scheduler->disk_cache.configure(dir, megabytes << 20, version))
+      return cmd.abort("cannot create cache directory");
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+bool setDiskCache(ThreadPool *pool, const char *dir, long bytes,
+    const char *version) {
+  return pool->scheduler->disk_cache.configure(dir, bytes, version);
+}
+
+static BOOLEAN threadPoolCacheStats(leftv result, leftv arg) {
+  Command cmd("threadPoolCacheStats", result, arg);
+  cmd.check_argc(1);
+  cmd.check_arg(0, type_threadpool, "argument must be a threadpool");
+  cmd.check_init(0, "threadpool not initialized");
+  if (cmd.ok()) {
+    ThreadPool *pool = cmd.shared_arg<ThreadPool>(0);
+    long stats[4];
+    pool->scheduler->cache.stats(stats[0], stats[1], stats[2], stats[3]);
+    lists l = (lists) omAlloc0Bin(slists_bin);
+    l->Init(4);
+    for (int i = 0; i < 4; i++) {
+      l->m[i].rtyp = INT_CMD;
+      l->m[i].data = (char *) stats[i];
+    }
+    cmd.set_result(LIST_CMD, l);
+  }
+  return cmd.status();
+}
+
+void getResultCacheStats(ThreadPool *pool, long *hits, long *misses,
+    long *entries, long *bytes) {
+  long size;
+  pool->scheduler->cache.stats(*hits, *misses, *entries, size);
+  if (bytes) *bytes = size;
+}
+
+static BOOLEAN setCoreBudget(leftv result, leftv arg) {
+  Command cmd("setCoreBudget", result, arg);
+  cmd.check_argc(1);
+  cmd.check_arg(0, INT_CMD, "argument must be an integer");
+  if (cmd.ok()) {
+    long cores = cmd.int_arg(0);
+    if (cores < 0)
+      return cmd.abort("core budget must be non-negative");
+    core_budget.setLimit(cores);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+void setCoreBudget(long cores) {
+  core_budget.setLimit(cores);
+}
+
+static BOOLEAN setThreadPoolWeight(leftv result, leftv arg) {
+  Command cmd("setThreadPoolWeight", result, arg);
+  cmd.check_argc(2);
+  cmd.check_arg(0, type_threadpool, "first argument must be a threadpool");
+  cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(1, INT_CMD, "second argument must be an integer");
+  if (cmd.ok()) {
+    ThreadPool *pool = cmd.shared_arg<ThreadPool>(0);
+    long weight = cmd.int_arg(1);
+    if (weight <= 0)
+      return cmd.abort("weight must be positive");
+    pool->scheduler->setWeight(weight);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+void setThreadPoolWeight(ThreadPool *pool, long weight) {
+  pool->scheduler->setWeight(weight);
+}
+
 
 BOOLEAN currentThreadPool(leftv result, leftv arg) {
   Command cmd("currentThreadPool", result, arg);
@@ -2215,98 +4439,477 @@ BOOLEAN setCurrentThreadPool(leftv result, leftv arg) {
 
 class EvalJob : public Job {
 public:
-  EvalJob() : Job() { }
+  EvalJob() : Job() { }
+  virtual void execute() {
+    leftv val = LinTree::from_string(args[0]);
+    result = (LinTree::to_string(val));
+    val->CleanUp();
+    omFreeBin(val, sleftv_bin);
+  }
+};
+
+class ExecJob : public Job {
+public:
+  ExecJob() : Job() { }
+  virtual void execute() {
+    procGeneration++;
+    // Cached results may stem from procedures that are redefined now.
+    pool->scheduler->cache.clear();
+    leftv val = LinTree::from_string(args[0]);
+    val->CleanUp();
+    omFreeBin(val, sleftv_bin);
+  }
+};
+
+// Turn the arguments of the job into bound arguments that can be shared
+// with jobs created from it, and return those. While the job runs, its
+// arguments are in use, so they are copied once instead; the job adopts
+// the copy when it has finished. Must be called with the scheduler lock
+// held if the job has been scheduled.
+JobArgs *Job::freezeArgs() {
+  if (args.size() == 0 && !frozen_args)
+    return bound_args;
+  if (pool && (running || broadcast)) {
+    if (!frozen_args) {
+      frozen_args = new JobArgs(bound_args);
+      acquireShared(frozen_args);
+      frozen_args->args = args;
+      for (int i = 0; i < args.size(); i++)
+        acquireEncoding(frozen_args->args[i]);
+    }
+    return frozen_args;
+  }
+  JobArgs *frozen = frozen_args;
+  if (!frozen) {
+    frozen = new JobArgs(bound_args);
+    acquireShared(frozen);
+    frozen->args.swap(args);
+  }
+  frozen_args = NULL;
+  releaseEncodings(args); // if the copy was adopted
+  vector<string>().swap(args);
+  if (bound_args)
+    releaseShared(bound_args);
+  bound_args = frozen;
+  return bound_args;
+}
+
+static Lock template_lock;
+
+// Create a job from a template job. The encoded arguments of the
+// template are frozen into shared bound arguments once and then shared
+// with every new job rather than copied.
+static Job *instantiateJob(Job *tmpl) {
+  Job *job = tmpl->instantiate();
+  if (!job)
+    return NULL;
+  ThreadPool *pool = tmpl->pool;
+  if (pool) pool->scheduler->lock.lock();
+  template_lock.lock();
+  JobArgs *bound = tmpl->freezeArgs();
+  if (bound)
+    acquireShared(bound);
+  job->bound_args = bound;
+  job->prio = tmpl->prio;
+  job->mem_estimate = tmpl->mem_estimate;
+  template_lock.unlock();
+  if (pool) pool->scheduler->lock.unlock();
+  return job;
+}
+
+class ProcJob : public Job {
+  string procname;
+public:
+  ProcJob(const char *procname_init) : Job(),
+    procname(procname_init) {
+    set_name(procname_init);
+  }
+  virtual Job *instantiate() {
+    return new ProcJob(procname.c_str());
+  }
+  virtual bool cacheKey(string &key) {
+    key = procname;
+    key.push_back('\0');
+    vector<string *> parts;
+    if (bound_args)
+      bound_args->collect(parts);
+    for (int i = 0; i < args.size(); i++)
+      parts.push_back(&args[i]);
+    for (int i = 0; i < deps.size(); i++) {
+      if (deps[i]->live_result)
+        return false;
+      parts.push_back(&deps[i]->result);
+    }
+    // length-prefixed, so that different argument lists never collide
+    for (int i = 0; i < parts.size(); i++) {
+      if (holdsReferences(*parts[i]))
+        return false;
+    }
+    for (int i = 0; i < parts.size(); i++) {
+      char buf[24];
+      sprintf(buf, "%lu:", (unsigned long) parts[i]->size());
+      key.append(buf);
+      key.append(*parts[i]);
+    }
+    return true;
+  }
+  virtual void execute() {
+    vector<leftv> argv;
+    collectArgs(argv);
+    sleftv val;
+    int error = executeProc(val, procname.c_str(), argv);
+    if (!error)
+      setResult(val);
+  }
+};
+
+class KernelJob : public Job {
+private:
+  void (*cfunc)(leftv result, leftv arg);
+public:
+  KernelJob(void (*func)(leftv result, leftv arg)) : cfunc(func) { }
+  virtual Job *instantiate() {
+    return new KernelJob(cfunc);
+  }
+  virtual void execute() {
+    vector<leftv> argv;
+    collectArgs(argv);
+    sleftv val;
+    memset(&val, 0, sizeof(val));
+    if (argv.size() > 0) {
+      leftv *tail = &argv[0]->next;
+      for (int i = 1; i < argv.size(); i++) {
+	*tail = argv[i];
+	tail = &(*tail)->next;
+      }
+      *tail = NULL;
+    }
+    cfunc(&val, argv[0]);
+    setResult(val);
+  }
+};
+
+class RawKernelJob : public Job {
+private:
+  void (*cfunc)(long ndeps, Job **deps);
+public:
+  RawKernelJob(void (*func)(long ndeps, Job **deps)) : cfunc(func) { }
+  virtual Job *instantiate() {
+    return new RawKernelJob(cfunc);
+  }
+  virtual void execute() {
+    long ndeps = deps.size();
+    Job **jobs = (Job **) omAlloc0(sizeof(Job *) * ndeps);
+    for (long i = 0; i < ndeps; i++)
+      jobs[i] = deps[i];
+    cfunc(ndeps, jobs);
+    omFree(jobs);
+  }
+};
+
+// Combines the results of all dependencies into a list.
+class WhenAllJob : public Job {
+public:
+  virtual void execute() {
+    lists l = (lists) omAlloc0Bin(slists_bin);
+    l->Init(deps.size());
+    for (int i = 0; i < deps.size(); i++) {
+      leftv val = resultValue(deps[i]);
+      if (!val) {
+        l->m[i].rtyp = NONE;
+        continue;
+      }
+      memcpy(&l->m[i], val, sizeof(*val));
+      omFreeBin(val, sleftv_bin);
+    }
+    sleftv val;
+    memset(&val, 0, sizeof(val));
+    val.rtyp = LIST_CMD;
+    val.data = l;
+    setResult(val);
+  }
+};
+
+// Becomes ready as soon as one of its dependencies has finished; the
+// result is a list containing the (1-based) index of that dependency
+// and its result. It is only cancelled if all dependencies are.
+class WhenAnyJob : public Job {
+  long finished() {
+    for (long i = 0; i < deps.size(); i++) {
+      if (deps[i]->done && !deps[i]->cancelled)
+        return i;
+    }
+    return -1;
+  }
+public:
+  virtual bool ready() {
+    return finished() >= 0;
+  }
+  virtual bool depsCancelled() {
+    for (int i = 0; i < deps.size(); i++) {
+      if (!deps[i]->cancelled) return false;
+    }
+    return true;
+  }
   virtual void execute() {
-    leftv val = LinTree::from_string(args[0]);
-    result = (LinTree::to_string(val));
-    val->CleanUp();
-    omFreeBin(val, sleftv_bin);
+    long index = finished();
+    lists l = (lists) omAlloc0Bin(slists_bin);
+    l->Init(2);
+    l->m[0].rtyp = INT_CMD;
+    l->m[0].data = (char *)(index + 1);
+    leftv value = resultValue(deps[index]);
+    if (value) {
+      memcpy(&l->m[1], value, sizeof(*value));
+      omFreeBin(value, sleftv_bin);
+    }
+    sleftv val;
+    memset(&val, 0, sizeof(val));
+    val.rtyp = LIST_CMD;
+    val.data = l;
+    setResult(val);
   }
 };
 
-class ExecJob : public Job {
+// Shared state of a parallelMap() call. The input list is encoded
+// once per block of elements; each block's results are encoded once.
+// The waiter counts the jobs working on the map, including those that
+// are split off while it runs.
+struct MapTask {
+  string procname;
+  vector<string> blocks;
+  vector<string> results;
+  JobWaiter waiter;
+  std::atomic<bool> failed; // set by any worker, polled by all
+  MapTask(const char *procname_init) : procname(procname_init),
+    waiter(1), failed(false) { }
+  ~MapTask() {
+    releaseEncodings(blocks);
+    releaseEncodings(results);
+  }
+};
+
+// Maps a procedure over the blocks [lo, hi) of a MapTask. Splitting is
+// lazy: the upper half of the remaining range is only handed off as a
+// new job while other workers are idle, so that cheap elements are
+// processed in long sequential runs and expensive ones spread out.
+class MapJob : public Job {
+  MapTask *task;
+  long lo, hi;
+  bool runBlock(long b) {
+    leftv block = LinTree::from_string(task->blocks[b]);
+    lists in = (lists) block->data;
+    int n = lSize(in) + 1;
+    lists out = (lists) omAlloc0Bin(slists_bin);
+    out->Init(n);
+    bool ok = true;
+    for (int i = 0; i < n && ok; i++) {
+      vector<leftv> argv;
+      appendArgCopy(argv, &in->m[i]);
+      sleftv val;
+      if (executeProc(val, task->procname.c_str(), argv))
+        ok = false;
+      else
+        memcpy(&out->m[i], &val, sizeof(val));
+    }
+    block->CleanUp();
+    omFreeBin(block, sleftv_bin);
+    sleftv val;
+    memset(&val, 0, sizeof(val));
+    val.rtyp = LIST_CMD;
+    val.data = out;
+    if (ok)
+      task->results[b] = LinTree::to_string(&val);
+    val.CleanUp();
+    return ok;
+  }
 public:
-  ExecJob() : Job() { }
+  MapJob(MapTask *task_init, long lo_init, long hi_init) : Job(),
+    task(task_init), lo(lo_init), hi(hi_init) {
+    waiters.push_back(&task->waiter);
+  }
   virtual void execute() {
-    leftv val = LinTree::from_string(args[0]);
-    val->CleanUp();
-    omFreeBin(val, sleftv_bin);
+    Scheduler *scheduler = pool->scheduler;
+    while (lo < hi && !task->failed) {
+      while (hi - lo > 1 && scheduler->hasIdleWorkers()) {
+        long mid = lo + (hi - lo) / 2;
+        task->waiter.lock.lock();
+        task->waiter.needed++;
+        task->waiter.lock.unlock();
+        scheduler->enqueueJob(pool, new MapJob(task, mid, hi));
+        hi = mid;
+      }
+      if (!runBlock(lo++))
+        task->failed = true;
+    }
   }
 };
 
-class ProcJob : public Job {
-  string procname;
+// Shared state of a mapIdeal() call. The shared value is encoded
+// together with the ring of the ideal and decoded at most once per
+// worker into that worker's slot, which only it accesses; a broadcast
+// job frees the slots afterwards.
+struct IdealMapTask {
+  string shared;
+  poly (*func)(poly p, leftv shared);
+  vector<string> chunks;
+  vector<string> results;
+  vector<ring> rings;
+  vector<leftv> values;
+  vector<pthread_t> owners;
+  JobWaiter waiter;
+  IdealMapTask(long nchunks, int nthreads) :
+    chunks(nchunks), results(nchunks), rings(nthreads), values(nthreads),
+    owners(nthreads), waiter(nchunks) { }
+};
+
+class IdealMapJob : public Job {
+  IdealMapTask *task;
+  long index;
 public:
-  ProcJob(const char *procname_init) : Job(),
-    procname(procname_init) {
-    set_name(procname_init);
+  IdealMapJob(IdealMapTask *task_init, long index_init) : Job(),
+    task(task_init), index(index_init) {
+    waiters.push_back(&task->waiter);
   }
   virtual void execute() {
-    vector<leftv> argv;
-    for (int i = 0; i <args.size(); i++) {
-      appendArg(argv, args[i]);
+    int num = worker;
+    if (!task->rings[num]) {
+      // The first value is a zero polynomial that carries the ring.
+      LinTree::LinTree in(task->shared);
+      leftv zero = LinTree::decode(in);
+      omFreeBin(zero, sleftv_bin);
+      task->values[num] = LinTree::decode(in);
+      task->rings[num] = (ring) in.get_last_ring();
+      task->owners[num] = pthread_self();
     }
-    for (int i = 0; i < deps.size(); i++) {
-      appendArg(argv, deps[i]->result);
+    ring r = task->rings[num];
+    ring oldRing = currRing;
+    rChangeCurrRing(r);
+    LinTree::LinTree in(task->chunks[index]);
+    LinTree::LinTree out;
+    int n = in.get_int();
+    out.put_int(n);
+    for (int i = 0; i < n; i++) {
+      poly p = task->func(LinTree::decode_poly(in, r), task->values[num]);
+      LinTree::encode_poly(out, POLY_CMD, p, r);
+      p_Delete(&p, r);
     }
-    sleftv val;
-    int error = executeProc(val, procname.c_str(), argv);
-    if (!error) {
-      result = (LinTree::to_string(&val));
-      val.CleanUp();
+    task->results[index] = out.to_string();
+    // Also if there was no ring before, as this one is killed later.
+    rChangeCurrRing(oldRing);
+  }
+};
+
+// Frees the per-worker slots of an IdealMapTask; it is broadcast to
+// all workers, so that each frees its own. Broadcast jobs run on all
+// workers at once, so the worker field cannot identify the slot.
+class IdealMapCleanupJob : public Job {
+  IdealMapTask *task;
+  JobWaiter *waiter;
+public:
+  IdealMapCleanupJob(IdealMapTask *task_init, JobWaiter *waiter_init) :
+    Job(), task(task_init), waiter(waiter_init) { }
+  virtual void execute() {
+    for (int i = 0; i < task->rings.size(); i++) {
+      ring r = task->rings[i];
+      if (r && pthread_equal(task->owners[i], pthread_self())) {
+        task->values[i]->CleanUp(r);
+        omFreeBin(task->values[i], sleftv_bin);
+        if (currRing == r)
+          rChangeCurrRing(NULL);
+        rKill(r);
+      }
     }
+    waiter->notify();
   }
 };
 
-class KernelJob : public Job {
-private:
-  void (*cfunc)(leftv result, leftv arg);
+// Folds a run of consecutive elements with the combining procedure,
+// after applying the leaf procedure (if any) to each of them, so that
+// a reduction tree needs one leaf job per run rather than per element.
+class ReduceLeafJob : public Job {
+  string combine, leaf;
 public:
-  KernelJob(void (*func)(leftv result, leftv arg)) : cfunc(func) { }
+  ReduceLeafJob(const char *combine_init, const char *leaf_init) : Job(),
+    combine(combine_init), leaf(leaf_init) {
+    set_name(combine_init);
+  }
   virtual void execute() {
     vector<leftv> argv;
-    for (int i = 0; i <args.size(); i++) {
-      appendArg(argv, args[i]);
-    }
-    for (int i = 0; i < deps.size(); i++) {
-      appendArg(argv, deps[i]->result);
+    collectArgs(argv);
+    leftv acc = NULL;
+    for (int i = 0; i < argv.size(); i++) {
+      leftv val = argv[i];
+      argv[i] = NULL;
+      if (leaf.size() > 0) {
+        vector<leftv> leafargs(1, val);
+        val = (leftv) omAlloc0Bin(sleftv_bin);
+        if (executeProc(*val, leaf.c_str(), leafargs)) {
+          omFreeBin(val, sleftv_bin);
+          val = NULL;
+        }
+      }
+      if (val && acc) {
+        vector<leftv> operands;
+        operands.push_back(acc);
+        operands.push_back(val);
+        acc = (leftv) omAlloc0Bin(sleftv_bin);
+        if (executeProc(*acc, combine.c_str(), operands)) {
+          omFreeBin(acc, sleftv_bin);
+          acc = NULL;
+          break;
+        }
+      } else if (val) {
+        acc = val;
+      } else {
+        if (acc) {
+          acc->CleanUp();
+          omFreeBin(acc, sleftv_bin);
+          acc = NULL;
+        }
+        break;
+      }
     }
-    sleftv val;
-    memset(&val, 0, sizeof(val));
-    if (argv.size() > 0) {
-      leftv *tail = &argv[0]->next;
-      for (int i = 1; i < argv.size(); i++) {
-	*tail = argv[i];
-	tail = &(*tail)->next;
+    for (int i = 0; i < argv.size(); i++) {
+      if (argv[i]) {
+        argv[i]->CleanUp();
+        omFreeBin(argv[i], sleftv_bin);
       }
-      *tail = NULL;
     }
-    cfunc(&val, argv[0]);
-    result = (LinTree::to_string(&val));
-    val.CleanUp();
+    if (acc) {
+      setResult(*acc);
+      omFreeBin(acc, sleftv_bin);
+    }
   }
 };
 
-class RawKernelJob : public Job {
-private:
-  void (*cfunc)(long ndeps, Job **deps);
+class NativeJob : public Job {
 public:
-  RawKernelJob(void (*func)(long ndeps, Job **deps)) : cfunc(func) { }
+  NativeJobBody *body;
+  NativeJob(NativeJobBody *b) : body(b) { }
+  virtual ~NativeJob() { delete body; }
   virtual void execute() {
-    long ndeps = deps.size();
-    Job **jobs = (Job **) omAlloc0(sizeof(Job *) * ndeps);
-    for (long i = 0; i < ndeps; i++)
-      jobs[i] = deps[i];
-    cfunc(ndeps, jobs);
-    omFree(jobs);
+    body->run();
   }
 };
 
 static BOOLEAN createJob(leftv result, leftv arg) {
   Command cmd("createJob", result, arg);
   cmd.check_argc_min(1);
+  if (cmd.test_arg(0, type_job)) {
+    cmd.check_init(0, "job not initialized");
+    if (!cmd.ok())
+      return cmd.status();
+    Job *job = instantiateJob(cmd.shared_arg<Job>(0));
+    if (!job)
+      return cmd.abort("job cannot be used as a template");
+    for (leftv a = arg->next; a != NULL; a = a->next) {
+      job->args.push_back(LinTree::to_string(a));
+    }
+    cmd.set_result(type_job, new_shared(job));
+    return cmd.status();
+  }
   cmd.check_arg(0, STRING_CMD, COMMAND,
-    "job name must be a string or quote expression");
+    "job name must be a job, string, or quote expression");
   if (cmd.ok()) {
     if (cmd.test_arg(0, STRING_CMD)) {
       ProcJob *job = new ProcJob((char *)(cmd.arg(0)));
@@ -2324,23 +4927,71 @@ static BOOLEAN createJob(leftv result, leftv arg) {
   return cmd.status();
 }
 
+// Jobs and groups created through the kernel interface start with a
+// reference owned by the caller.
+
 Job *createJob(void (*func)(leftv result, leftv arg)) {
   KernelJob *job = new KernelJob(func);
+  acquireShared(job);
   return job;
 }
 
 Job *createJob(void (*func)(long ndeps, Job **deps)) {
   RawKernelJob *job = new RawKernelJob(func);
+  acquireShared(job);
+  return job;
+}
+
+Job *createJob(Job *tmpl, leftv arg) {
+  Job *job = instantiateJob(tmpl);
+  if (!job) return NULL;
+  acquireShared(job);
+  while (arg) {
+    job->args.push_back(LinTree::to_string(arg));
+    arg = arg->next;
+  }
+  return job;
+}
+
+Job *createJob(Job *tmpl) {
+  return createJob(tmpl, NULL);
+}
+
+Job *createNativeJob(NativeJobBody *body) {
+  Job *job = new NativeJob(body);
+  acquireShared(job);
   return job;
 }
 
+NativeJobBody *getNativeJobBody(Job *job) {
+  NativeJob *native = dynamic_cast<NativeJob *>(job);
+  return native ? native->body : NULL;
+}
+
+// Drop the arguments added to a job after the first n, as it could not
+// be started; a later attempt must not pass them twice.
+static void truncateArgs(Job *job, size_t n) {
+  for (size_t i = n; i < job->args.size(); i++)
+    releaseEncoding(job->args[i]);
+  job->args.resize(n);
+}
+
 Job *startJob(ThreadPool *pool, Job *job, leftv arg) {
   if (job->pool) return NULL;
+  if (pool->scheduler->queueFull()) return NULL;
+  size_t nargs = job->args.size();
   while (arg) {
     job->args.push_back(LinTree::to_string(arg));
     arg = arg->next;
   }
-  pool->attachJob(job);
+  switch (pool->attachJob(job)) {
+    case AdmitReject:
+      truncateArgs(job, nargs);
+      return NULL;
+    case AdmitInline:
+      pool->scheduler->runJobInline(job);
+      break;
+  }
   return job;
 }
 
@@ -2348,22 +4999,157 @@ Job *startJob(ThreadPool *pool, Job *job) {
   return startJob(pool, job, NULL);
 }
 
+Job *startJobOn(ThreadPool *pool, int worker, Job *job, leftv arg) {
+  if (job->pool) return NULL;
+  if (worker < 0 || worker >= pool->scheduler->numWorkers()) return NULL;
+  job->affinity = worker;
+  if (!startJob(pool, job, arg)) {
+    job->affinity = -1;
+    return NULL;
+  }
+  return job;
+}
+
+Job *startJobOn(ThreadPool *pool, int worker, Job *job) {
+  return startJobOn(pool, worker, job, NULL);
+}
+
 Job *scheduleJob(ThreadPool *pool, Job *job, long ndeps, Job **deps) {
   if (job->pool) return NULL;
+  // Live results can only be exchanged between workers of one pool.
+  for (long i = 0; i < ndeps; i++) {
+    if (deps[i]->pool != pool) return NULL;
+  }
   pool->scheduler->lock.lock();
-  bool cancelled = false;
+  if (pool->scheduler->admitJobs(1, false) == AdmitReject) {
+    pool->scheduler->lock.unlock();
+    return NULL;
+  }
   job->addDep(ndeps, deps);
   for (long i = 0; i < ndeps; i++) {
     deps[i]->addNotify(job);
-    cancelled |= deps[i]->cancelled;
   }
-  if (cancelled) {
-    job->pool = pool;
+  if (job->depsCancelled()) {
+    job->setPool(pool);
     pool->cancelJob(job);
   }
   else
-    pool->attachJob(job);
+    pool->scheduler->enqueueJob(pool, job);
   pool->scheduler->lock.unlock();
+  return job;
+}
+
+JobGroup *createJobGroup(JobGroup *parent) {
+  JobGroup *group = new JobGroup(parent);
+  acquireShared(group);
+  return group;
+}
+
+JobGroup *getCurrentJobGroup() {
+  return currentJobGroupRef;
+}
+
+void setCurrentJobGroup(JobGroup *group) {
+  if (group) acquireShared(group);
+  if (currentJobGroupRef) releaseShared(currentJobGroupRef);
+  currentJobGroupRef = group;
+}
+
+void waitGroup(JobGroup *group) {
+  CoreLender lender;
+  flushWorkerResults();
+  group_lock.lock();
+  while (group->outstanding > 0) {
+    // Jobs on pools without worker threads only run when waited for.
+    Job *job = group->unthreadedJob();
+    if (job) {
+      acquireShared(job);
+      group_lock.unlock();
+      job->pool->waitJob(job);
+      releaseShared(job);
+      group_lock.lock();
+    } else {
+      lender.wait(group->cond);
+    }
+  }
+  group_lock.unlock();
+  lender.reclaim();
+}
+
+static bool byPool(Job *a, Job *b) {
+  return a->pool < b->pool;
+}
+
+void cancelGroup(JobGroup *group) {
+  EpochGuard guard;
+  vector<Job *> victims;
+  group_lock.lock();
+  group->cancel(victims);
+  group_lock.unlock();
+  // Cancel jobs in batches, taking each scheduler lock only once.
+  std::sort(victims.begin(), victims.end(), byPool);
+  for (int i = 0; i < victims.size(); ) {
+    Scheduler *scheduler = victims[i]->pool->scheduler;
+    scheduler->lock.lock();
+    int j = i;
+    while (j < victims.size() && victims[j]->pool == victims[i]->pool)
+      scheduler->cancelJob(victims[j++]);
+    scheduler->lock.unlock();
+    i = j;
+  }
+  for (int i = 0; i < victims.size(); i++)
+    releaseShared(victims[i]);
+}
+
+void release(JobGroup *group) {
+  releaseShared(group);
+}
+
+void retain(JobGroup *group) {
+  acquireShared(group);
+}
+
+void release(Job *job) {
+  releaseShared(job);
+}
+
+void retain(Job *job) {
+  acquireShared(job);
+}
+
+Job *then(Job *job, Job *cont) {
+  if (!job->pool) return NULL;
+  return scheduleJob(job->pool, cont, 1, &job);
+}
+
+static Job *scheduleCombinator(Job *combinator, long njobs, Job **jobs) {
+  if (njobs == 0) {
+    delete combinator;
+    return NULL;
+  }
+  ThreadPool *pool = jobs[0]->pool;
+  for (long i = 0; i < njobs; i++) {
+    if (!jobs[i]->pool || jobs[i]->pool != pool) {
+      delete combinator;
+      return NULL;
+    }
+  }
+  // The combinator may finish as soon as it has been scheduled, so the
+  // caller's reference must be taken first.
+  acquireShared(combinator);
+  if (!scheduleJob(pool, combinator, njobs, jobs)) {
+    releaseShared(combinator);
+    return NULL;
+  }
+  return combinator;
+}
+
+Job *whenAll(long njobs, Job **jobs) {
+  return scheduleCombinator(new WhenAllJob(), njobs, jobs);
+}
+
+Job *whenAny(long njobs, Job **jobs) {
+  return scheduleCombinator(new WhenAnyJob(), njobs, jobs);
 }
 
 void cancelJob(Job *job) {
@@ -2399,21 +5185,87 @@ static BOOLEAN startJob(leftv result, leftv arg) {
     pool = currentThreadPoolRef;
   }
   Job *job;
-  if (cmd.argtype(first_arg) == type_job) 
+  if (cmd.argtype(first_arg) == type_job) {
     job = *(Job **)(cmd.arg(first_arg));
-  else
+    if (job->pool)
+      return cmd.abort("job has already been scheduled");
+  } else
     job = new ProcJob((char *)(cmd.arg(first_arg)));
+  // The job may finish and be released by the pool before it has been
+  // returned, so it is referenced until then.
+  acquireShared(job);
+  size_t nargs = job->args.size();
   leftv a = arg->next;
   if (has_pool) a = a->next;
   if (has_prio) a = a->next;
   for (; a != NULL; a = a->next) {
     job->args.push_back(LinTree::to_string(a));
   }
-  if (job->pool)
-    return cmd.abort("job has already been scheduled");
   job->prio = prio;
-  pool->attachJob(job);
+  switch (pool->attachJob(job)) {
+    case AdmitReject:
+      truncateArgs(job, nargs);
+      releaseShared(job);
+      return cmd.abort("job queue is full");
+    case AdmitInline:
+      pool->scheduler->runJobInline(job);
+      break;
+  }
+  cmd.set_result(type_job, new_shared(job));
+  releaseShared(job);
+  return cmd.status();
+}
+
+static BOOLEAN startJobOn(leftv result, leftv arg) {
+  Command cmd("startJobOn", result, arg);
+  cmd.check_argc_min(3);
+  cmd.check_arg(0, type_threadpool, "first argument must be a threadpool");
+  cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(1, INT_CMD, "second argument must be an integer");
+  int has_prio = cmd.test_arg(2, INT_CMD);
+  int first_arg = 2 + has_prio;
+  cmd.check_arg(first_arg, type_job, STRING_CMD,
+    "job argument must be a job or string");
+  if (cmd.ok() && cmd.argtype(first_arg) == type_job)
+    cmd.check_init(first_arg, "job not initialized");
+  if (!cmd.ok()) return cmd.status();
+  ThreadPool *pool = cmd.shared_arg<ThreadPool>(0);
+  long worker = cmd.int_arg(1);
+  long prio = has_prio ? cmd.int_arg(2) : 0L;
+  if (worker < 1 || worker > pool->scheduler->numWorkers())
+    return cmd.abort("worker index out of range");
+  Job *job;
+  if (cmd.argtype(first_arg) == type_job) {
+    job = cmd.shared_arg<Job>(first_arg);
+    if (job->pool)
+      return cmd.abort("job has already been scheduled");
+  } else
+    job = new ProcJob((char *)(cmd.arg(first_arg)));
+  // The job may finish and be released by the pool before it has been
+  // returned, so it is referenced until then.
+  acquireShared(job);
+  if (pool->scheduler->queueFull()) {
+    releaseShared(job);
+    return cmd.abort("job queue is full");
+  }
+  size_t nargs = job->args.size();
+  leftv a = arg->next->next->next;
+  if (has_prio) a = a->next;
+  for (; a != NULL; a = a->next) {
+    job->args.push_back(LinTree::to_string(a));
+  }
+  job->prio = prio;
+  // Workers are numbered from 1 here, but from 0 in the kernel API.
+  job->affinity = (int) worker - 1;
+  if (pool->attachJob(job) == AdmitReject) {
+    // The queue filled up after it was checked.
+    truncateArgs(job, nargs);
+    job->affinity = -1;
+    releaseShared(job);
+    return cmd.abort("job queue is full");
+  }
   cmd.set_result(type_job, new_shared(job));
+  releaseShared(job);
   return cmd.status();
 }
 
@@ -2428,14 +5280,33 @@ static BOOLEAN waitJob(leftv result, leftv arg) {
     if (!pool) {
       return cmd.abort("job has not yet been started or scheduled");
     }
+    Scheduler *scheduler = pool->scheduler;
+    // Waiting threads count as readers of a consume-once result, so
+    // that it is kept until they have read it.
+    scheduler->lock.lock();
+    job->readers++;
+    scheduler->lock.unlock();
     pool->waitJob(job);
+    scheduler->fetchResult(job);
+    // The result is copied under the lock, as a consume-once result
+    // may be dropped by another reader at any time.
+    scheduler->lock.lock();
+    bool consumed = job->result_consumed;
+    string value = job->result;
+    acquireEncoding(value);
+    job->consumeResult();
+    scheduler->lock.unlock();
     if (job->cancelled) {
+      releaseEncoding(value);
       return cmd.abort("job has been cancelled");
     }
-    if (job->result.size() == 0)
+    if (consumed)
+      return cmd.abort("result has already been consumed");
+    if (value.size() == 0)
       cmd.no_result();
     else {
-      leftv res = LinTree::from_string(job->result);
+      leftv res = LinTree::from_string(value);
+      releaseEncoding(value);
       cmd.set_result(res->Typ(), res->Data());
     }
   }
@@ -2447,6 +5318,229 @@ void waitJob(Job *job) {
   job->pool->waitJob(job);
 }
 
+// The output stream of a started job, created if necessary.
+static JobStream *getJobStream(Job *job) {
+  Scheduler *scheduler = job->pool->scheduler;
+  scheduler->lock.lock();
+  if (!job->stream) {
+    job->stream = new JobStream(!scheduler->isSingleThreaded());
+    if (job->done)
+      job->stream->close();
+  }
+  JobStream *stream = job->stream;
+  scheduler->lock.unlock();
+  return stream;
+}
+
+// The output stream of a started job for reading. Jobs on pools without
+// worker threads only run when waited for, so they are run to completion
+// first; their streams buffer all values.
+static JobStream *readJobStream(Job *job) {
+  if (job->pool->scheduler->isSingleThreaded() && !job->done)
+    job->pool->waitJob(job);
+  return getJobStream(job);
+}
+
+void jobEmit(leftv value) {
+  Job *job = currentJobRef;
+  if (job)
+    getJobStream(job)->emit(LinTree::to_string(value));
+}
+
+leftv jobNext(Job *job) {
+  string value;
+  if (!readJobStream(job)->next(value, true))
+    return NULL;
+  leftv val = LinTree::from_string(value);
+  releaseEncoding(value);
+  return val;
+}
+
+void setJobStreamCapacity(Job *job, long capacity) {
+  getJobStream(job)->setCapacity(capacity);
+}
+
+// Run callback once job has finished; if it has already, run it right
+// away. Callbacks are not run for cancelled jobs.
+static void addJobCallback(Job *job, JobCallback *callback) {
+  ThreadPool *pool = job->pool;
+  if (pool) pool->scheduler->lock.lock();
+  bool done = job->done;
+  if (!done)
+    job->callbacks.push_back(callback);
+  if (pool) pool->scheduler->lock.unlock();
+  if (done) {
+    pool->scheduler->fetchResult(job);
+    if (!job->cancelled)
+      callback->run(job);
+    delete callback;
+  }
+}
+
+void onJobDone(Job *job, void (*func)(Job *job, void *data), void *data) {
+  addJobCallback(job, new KernelCallback(func, data));
+}
+
+static bool jobIndexByPool(const pair<Job *, long> &a,
+    const pair<Job *, long> &b) {
+  return a.first->pool < b.first->pool;
+}
+
+// Apply f to all jobs, holding the lock of each pool only once.
+template <typename F>
+static void forJobsByPool(vector<pair<Job *, long> > &jobs, F f) {
+  for (long i = 0; i < jobs.size(); ) {
+    Scheduler *scheduler = jobs[i].first->pool->scheduler;
+    scheduler->lock.lock();
+    long j = i;
+    while (j < jobs.size() && jobs[j].first->pool == jobs[i].first->pool) {
+      f(jobs[j].first, jobs[j].second);
+      j++;
+    }
+    scheduler->lock.unlock();
+    i = j;
+  }
+}
+
+// Wait until at least count of the given (scheduled) jobs have finished
+// or been cancelled and return the indices of those that have, in
+// ascending order.
+static void waitForJobs(long njobs, Job **jobs, long count,
+    vector<long> &finished) {
+  vector<pair<Job *, long> > sorted;
+  vector<Job *> unthreaded;
+  for (long i = 0; i < njobs; i++) {
+    sorted.push_back(make_pair(jobs[i], i));
+    if (jobs[i]->pool->scheduler->isSingleThreaded())
+      unthreaded.push_back(jobs[i]);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(), jobIndexByPool);
+  if (count > njobs) count = njobs;
+  flushWorkerResults();
+  JobWaiter waiter(count);
+  long already = 0;
+  forJobsByPool(sorted, [&](Job *job, long i) {
+    if (job->done)
+      already++;
+    else
+      job->waiters.push_back(&waiter);
+  });
+  CoreLender lender;
+  waiter.lock.lock();
+  waiter.needed -= already;
+  while (waiter.finished < waiter.needed) {
+    // Jobs on pools without worker threads only run when waited for.
+    if (!unthreaded.empty()) {
+      Job *job = unthreaded.back();
+      unthreaded.pop_back();
+      waiter.lock.unlock();
+      job->pool->waitJob(job);
+      waiter.lock.lock();
+      continue;
+    }
+    lender.wait(waiter.cond);
+  }
+  waiter.lock.unlock();
+  vector<bool> done(njobs);
+  forJobsByPool(sorted, [&](Job *job, long i) {
+    vector<JobWaiter *> &waiters = job->waiters;
+    vector<JobWaiter *>::iterator it =
+      std::find(waiters.begin(), waiters.end(), &waiter);
+    if (it != waiters.end())
+      waiters.erase(it);
+    done[i] = job->done || job->cancelled;
+  });
+  lender.reclaim();
+  for (long i = 0; i < njobs; i++) {
+    if (done[i])
+      finished.push_back(i);
+  }
+}
+
+long waitJobs(long njobs, Job **jobs, long count, long *finished) {
+  vector<long> indices;
+  waitForJobs(njobs, jobs, count, indices);
+  for (long i = 0; i < indices.size(); i++)
+    finished[i] = indices[i];
+  return indices.size();
+}
+
+ideal mapIdeal(ThreadPool *pool, ideal J, leftv shared,
+    poly (*func)(poly p, leftv shared), long chunk) {
+  Scheduler *scheduler = pool->scheduler;
+  long n = IDELEMS(J);
+  if (scheduler->currentWorker() >= 0) {
+    // The cleanup job needs every worker of the pool, including this
+    // one, so map sequentially instead.
+    ideal result = idInit(n, J->rank);
+    for (long i = 0; i < n; i++)
+      result->m[i] = func(pCopy(J->m[i]), shared);
+    return result;
+  }
+  if (chunk <= 0) chunk = 1;
+  long nchunks = (n + chunk - 1) / chunk;
+  int nthreads = scheduler->numWorkers();
+  IdealMapTask task(nchunks, nthreads);
+  task.func = func;
+  LinTree::LinTree lt;
+  sleftv zero;
+  memset(&zero, 0, sizeof(zero));
+  zero.rtyp = POLY_CMD;
+  LinTree::encode(lt, &zero);
+  LinTree::encode(lt, shared);
+  task.shared = lt.to_string();
+  vector<Job *> jobs;
+  for (long k = 0; k < nchunks; k++) {
+    LinTree::LinTree out;
+    long lo = k * chunk, hi = std::min(n, lo + chunk);
+    out.put_int((int)(hi - lo));
+    for (long i = lo; i < hi; i++)
+      LinTree::encode_poly(out, POLY_CMD, J->m[i], currRing);
+    task.chunks[k] = out.to_string();
+    jobs.push_back(new IdealMapJob(&task, k));
+  }
+  scheduler->lock.lock();
+  for (long k = 0; k < nchunks; k++) {
+    acquireShared(jobs[k]);
+    scheduler->enqueueJob(pool, jobs[k]);
+  }
+  scheduler->lock.unlock();
+  if (scheduler->isSingleThreaded()) {
+    for (long k = 0; k < nchunks; k++)
+      pool->waitJob(jobs[k]);
+  } else
+    awaitJobs(task.waiter);
+  JobWaiter cleanup_waiter(nthreads);
+  Job *cleanup = new IdealMapCleanupJob(&task, &cleanup_waiter);
+  acquireShared(cleanup);
+  cleanup->setPool(pool);
+  pool->broadcastJob(cleanup);
+  // Every worker has to get to the cleanup job, which may take a while
+  // if they are busy with other jobs, so the core is lent meanwhile.
+  if (scheduler->isSingleThreaded())
+    pool->waitJob(cleanup);
+  else
+    awaitJobs(cleanup_waiter);
+  releaseShared(cleanup);
+  ideal result = NULL;
+  bool complete = true;
+  for (long k = 0; k < nchunks; k++) {
+    if (task.results[k].size() == 0)
+      complete = false;
+    releaseShared(jobs[k]);
+  }
+  if (complete) {
+    result = idInit(n, J->rank);
+    for (long k = 0; k < nchunks; k++) {
+      LinTree::LinTree in(task.results[k]);
+      int m = in.get_int();
+      for (int i = 0; i < m; i++)
+        result->m[k * chunk + i] = LinTree::decode_poly(in, currRing);
+    }
+  }
+  return result;
+}
+
 static BOOLEAN cancelJob(leftv result, leftv arg) {
   Command cmd("cancelJob", result, arg);
   cmd.check_argc(1);
@@ -2501,13 +5595,61 @@ bool getJobCancelled() {
   return getJobCancelled(currentJobRef);
 }
 
-void setJobData(Job *job, void *data) {
+void setJobData(Job *job, void *data) {
+  ThreadPool *pool = job->pool;
+  if (pool) pool->scheduler->lock.lock();
+  job->data = data;
+  if (pool) pool->scheduler->lock.unlock();
+}
+
+
+void setJobMemory(Job *job, long bytes) {
+  ThreadPool *pool = job->pool;
+  if (pool) pool->scheduler->lock.lock();
+  job->mem_estimate = bytes;
+  if (pool) pool->scheduler->lock.unlock();
+}
+
+static BOOLEAN setJobMemory(leftv result, leftv arg) {
+  Command cmd("setJobMemory", result, arg);
+  cmd.check_argc(2);
+  cmd.check_arg(0, type_job, "first argument must be a job");
+  cmd.check_init(0, "job not initialized");
+  cmd.check_arg(1, INT_CMD, "second argument must be an integer");
+  if (cmd.ok()) {
+    Job *job = cmd.shared_arg<Job>(0);
+    long megabytes = cmd.int_arg(1);
+    if (megabytes < 0)
+      return cmd.abort("memory estimate must be non-negative");
+    if (job->running || job->done)
+      return cmd.abort("job is already running");
+    setJobMemory(job, megabytes << 20);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+void setJobResultOnce(Job *job) {
   ThreadPool *pool = job->pool;
   if (pool) pool->scheduler->lock.lock();
-  job->data = data;
+  job->result_once = true;
   if (pool) pool->scheduler->lock.unlock();
 }
 
+static BOOLEAN jobResultOnce(leftv result, leftv arg) {
+  Command cmd("jobResultOnce", result, arg);
+  cmd.check_argc(1);
+  cmd.check_arg(0, type_job, "argument must be a job");
+  cmd.check_init(0, "job not initialized");
+  if (cmd.ok()) {
+    Job *job = cmd.shared_arg<Job>(0);
+    if (job->running || job->done)
+      return cmd.abort("job is already running");
+    setJobResultOnce(job);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
 
 void *getJobData(Job *job) {
   ThreadPool *pool = job->pool;
@@ -2529,10 +5671,18 @@ void addJobArgs(Job *job, leftv arg) {
 
 leftv getJobResult(Job *job) {
   ThreadPool *pool = job->pool;
+  if (pool) pool->scheduler->fetchResult(job);
   if (pool) pool->scheduler->lock.lock();
-  leftv result = LinTree::from_string(job->result);
+  string value = job->result;
+  acquireEncoding(value);
+  job->readers++;
+  job->consumeResult();
   if (pool) pool->scheduler->lock.unlock();
-  return result;
+  if (value.size() == 0)
+    return NULL;
+  leftv val = LinTree::from_string(value);
+  releaseEncoding(value);
+  return val;
 }
 
 const char *getJobName(Job *job) {
@@ -2599,9 +5749,14 @@ static BOOLEAN updateTrigger(leftv result, leftv arg) {
       cmd.report("incompatible argument type(s) for this trigger");
     else {
       trigger->activate(arg->next);
-      if (trigger->ready()) {
+      if (!trigger->queued && !trigger->done && trigger->ready()) {
+        // Fired here instead of by a worker, which takes the place of
+        // queueing it.
+        trigger->queued = true;
+        trigger->pool->detachJob(trigger);
         trigger->run();
 	Scheduler::notifyDeps(trigger->pool->scheduler, trigger);
+        releaseShared(trigger);
       }
     }
     trigger->pool->scheduler->lock.unlock();
@@ -2624,6 +5779,7 @@ static BOOLEAN chainTrigger(leftv result, leftv arg) {
       return cmd.abort("arguments use different threadpools");
     ThreadPool *pool = trigger->pool;
     pool->scheduler->lock.lock();
+    acquireShared(trigger);
     job->triggers.push_back(trigger);
     pool->scheduler->lock.unlock();
   }
@@ -2668,10 +5824,11 @@ static BOOLEAN scheduleJob(leftv result, leftv arg) {
   }
   long prio = has_prio ? (long) cmd.arg(has_pool) : 0L;
   int first_arg = has_pool + has_prio;
+  const char *procname = NULL;
   if (cmd.test_arg(first_arg, type_job)) {
     jobs.push_back(*(Job **)(cmd.arg(first_arg)));
   } else if (cmd.test_arg(first_arg, STRING_CMD)) {
-    jobs.push_back(new ProcJob((char *)(cmd.arg(first_arg))));
+    procname = (char *)(cmd.arg(first_arg));
   } else if (cmd.test_arg(first_arg, LIST_CMD)) {
     lists l = (lists) (cmd.arg(first_arg));
     int n = lSize(l);
@@ -2727,26 +5884,784 @@ static BOOLEAN scheduleJob(leftv result, leftv arg) {
       return cmd.abort("dependency has been scheduled on a different threadpool");
     }
   }
+  // A job whose dependencies have all finished may run and finish
+  // before it is returned, so the new job is referenced until then.
+  Job *created = NULL;
+  if (procname) {
+    created = new ProcJob(procname);
+    created->prio = prio;
+    acquireShared(created);
+    jobs.push_back(created);
+  }
   pool->scheduler->lock.lock();
-  bool cancelled = false;
+  if (pool->scheduler->admitJobs(jobs.size(), false) == AdmitReject) {
+    pool->scheduler->lock.unlock();
+    if (created) releaseShared(created);
+    return cmd.abort("job queue is full");
+  }
   for (int i = 0; i < jobs.size(); i++) {
     jobs[i]->addDep(deps);
   }
   for (int i = 0; i < deps.size(); i++) {
     deps[i]->addNotify(jobs);
-    cancelled |= deps[i]->cancelled;
   }
   for (int i = 0; i < jobs.size(); i++) {
-    if (cancelled) {
-      jobs[i]->pool = pool;
+    if (jobs[i]->depsCancelled()) {
+      jobs[i]->setPool(pool);
       pool->cancelJob(jobs[i]);
     }
     else
-      pool->attachJob(jobs[i]);
+      pool->scheduler->enqueueJob(pool, jobs[i]);
   }
   pool->scheduler->lock.unlock();
   if (jobs.size() > 0)
     cmd.set_result(type_job, new_shared(jobs[0]));
+  if (created) releaseShared(created);
+  return cmd.status();
+}
+
+static BOOLEAN jobEmit(leftv result, leftv arg) {
+  Command cmd("jobEmit", result, arg);
+  cmd.check_argc(1);
+  Job *job = currentJobRef;
+  if (!job)
+    cmd.report("no current job");
+  if (cmd.ok()) {
+    getJobStream(job)->emit(LinTree::to_string(arg));
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+static BOOLEAN jobHasNext(leftv result, leftv arg) {
+  Command cmd("jobHasNext", result, arg);
+  cmd.check_argc(1);
+  cmd.check_arg(0, type_job, "argument must be a job");
+  cmd.check_init(0, "job not initialized");
+  if (cmd.ok()) {
+    Job *job = cmd.shared_arg<Job>(0);
+    if (!job->pool)
+      return cmd.abort("job has not yet been started or scheduled");
+    string value;
+    cmd.set_result((long) readJobStream(job)->next(value, false));
+  }
+  return cmd.status();
+}
+
+static BOOLEAN jobNext(leftv result, leftv arg) {
+  Command cmd("jobNext", result, arg);
+  cmd.check_argc(1);
+  cmd.check_arg(0, type_job, "argument must be a job");
+  cmd.check_init(0, "job not initialized");
+  if (cmd.ok()) {
+    Job *job = cmd.shared_arg<Job>(0);
+    if (!job->pool)
+      return cmd.abort("job has not yet been started or scheduled");
+    string value;
+    if (!readJobStream(job)->next(value, true))
+      return cmd.abort("job has no more values");
+    leftv val = LinTree::from_string(value);
+    releaseEncoding(value);
+    cmd.set_result(val->Typ(), val->Data());
+    omFreeBin(val, sleftv_bin);
+  }
+  return cmd.status();
+}
+
+static BOOLEAN setJobStreamCapacity(leftv result, leftv arg) {
+  Command cmd("setJobStreamCapacity", result, arg);
+  cmd.check_argc(2);
+  cmd.check_arg(0, type_job, "first argument must be a job");
+  cmd.check_init(0, "job not initialized");
+  cmd.check_arg(1, INT_CMD, "second argument must be an integer");
+  if (cmd.ok()) {
+    Job *job = cmd.shared_arg<Job>(0);
+    long capacity = cmd.int_arg(1);
+    if (!job->pool)
+      return cmd.abort("job has not yet been started or scheduled");
+    if (capacity <= 0)
+      return cmd.abort("capacity must be positive");
+    getJobStream(job)->setCapacity(capacity);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+static BOOLEAN onJobDone(leftv result, leftv arg) {
+  Command cmd("onJobDone", result, arg);
+  cmd.check_argc(2);
+  cmd.check_arg(0, type_job, "first argument must be a job");
+  cmd.check_init(0, "job not initialized");
+  cmd.check_arg(1, STRING_CMD, "second argument must be a string");
+  if (cmd.ok()) {
+    Job *job = cmd.shared_arg<Job>(0);
+    addJobCallback(job, new ProcCallback((const char *) cmd.arg(1)));
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+static BOOLEAN waitJobs(leftv result, leftv arg) {
+  Command cmd("waitJobs", result, arg);
+  cmd.check_argc(1, 2);
+  cmd.check_arg(0, LIST_CMD, "first argument must be a list of jobs");
+  if (cmd.nargs() == 2)
+    cmd.check_arg(1, STRING_CMD, INT_CMD,
+      "second argument must be \"any\", \"all\", or an integer");
+  if (!cmd.ok())
+    return cmd.status();
+  lists l = (lists) cmd.arg(0);
+  long n = lSize(l) + 1;
+  vector<Job *> jobs;
+  for (long i = 0; i < n; i++) {
+    if (l->m[i].Typ() != type_job || !*(Job **)(l->m[i].Data()))
+      return cmd.abort("first argument must be a list of jobs");
+    Job *job = *(Job **)(l->m[i].Data());
+    if (!job->pool)
+      return cmd.abort("job has not yet been started or scheduled");
+    jobs.push_back(job);
+  }
+  long count = n;
+  if (cmd.test_arg(1, STRING_CMD)) {
+    const char *mode = (const char *) cmd.arg(1);
+    if (strcmp(mode, "any") == 0)
+      count = 1;
+    else if (strcmp(mode, "all") != 0)
+      return cmd.abort("second argument must be \"any\", \"all\", or an integer");
+  } else if (cmd.test_arg(1, INT_CMD)) {
+    count = cmd.int_arg(1);
+    if (count < 0)
+      return cmd.abort("number of jobs must be non-negative");
+  }
+  vector<long> finished;
+  if (n > 0)
+    waitForJobs(n, &jobs[0], count, finished);
+  lists r = (lists) omAlloc0Bin(slists_bin);
+  r->Init(finished.size());
+  for (long i = 0; i < finished.size(); i++) {
+    r->m[i].rtyp = INT_CMD;
+    r->m[i].data = (char *)(finished[i] + 1);
+  }
+  cmd.set_result(LIST_CMD, r);
+  return cmd.status();
+}
+
+static BOOLEAN createJobGroup(leftv result, leftv arg) {
+  Command cmd("createJobGroup", result, arg);
+  cmd.check_argc(0, 1);
+  JobGroup *parent = currentJobGroupRef;
+  if (cmd.nargs() == 1) {
+    cmd.check_arg(0, type_jobgroup, "argument must be a job group");
+    cmd.check_init(0, "job group not initialized");
+    if (cmd.ok())
+      parent = cmd.shared_arg<JobGroup>(0);
+  }
+  if (cmd.ok()) {
+    cmd.set_result(type_jobgroup, new_shared(new JobGroup(parent)));
+  }
+  return cmd.status();
+}
+
+static BOOLEAN currentJobGroup(leftv result, leftv arg) {
+  Command cmd("currentJobGroup", result, arg);
+  cmd.check_argc(0);
+  JobGroup *group = currentJobGroupRef;
+  if (group) {
+    cmd.set_result(type_jobgroup, new_shared(group));
+  } else {
+    cmd.report("no current job group");
+  }
+  return cmd.status();
+}
+
+static BOOLEAN setCurrentJobGroup(leftv result, leftv arg) {
+  Command cmd("setCurrentJobGroup", result, arg);
+  cmd.check_argc(0, 1);
+  JobGroup *group = NULL;
+  if (cmd.nargs() == 1) {
+    cmd.check_arg(0, type_jobgroup, "argument must be a job group");
+    cmd.check_init(0, "job group not initialized");
+    if (cmd.ok())
+      group = cmd.shared_arg<JobGroup>(0);
+  }
+  if (cmd.ok()) {
+    setCurrentJobGroup(group);
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+static BOOLEAN waitGroup(leftv result, leftv arg) {
+  Command cmd("waitGroup", result, arg);
+  cmd.check_argc(1);
+  cmd.check_arg(0, type_jobgroup, "argument must be a job group");
+  cmd.check_init(0, "job group not initialized");
+  if (cmd.ok()) {
+    waitGroup(cmd.shared_arg<JobGroup>(0));
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+static BOOLEAN cancelGroup(leftv result, leftv arg) {
+  Command cmd("cancelGroup", result, arg);
+  cmd.check_argc(1);
+  cmd.check_arg(0, type_jobgroup, "argument must be a job group");
+  cmd.check_init(0, "job group not initialized");
+  if (cmd.ok()) {
+    cancelGroup(cmd.shared_arg<JobGroup>(0));
+    cmd.no_result();
+  }
+  return cmd.status();
+}
+
+static BOOLEAN then(leftv result, leftv arg) {
+  Command cmd("then", result, arg);
+  cmd.check_argc_min(2);
+  cmd.check_arg(0, type_job, "first argument must be a job");
+  cmd.check_init(0, "job not initialized");
+  cmd.check_arg(1, STRING_CMD, type_job,
+    "continuation must be a string or job");
+  if (cmd.ok()) {
+    Job *job = cmd.shared_arg<Job>(0);
+    if (!job->pool)
+      return cmd.abort("job has not yet been scheduled");
+    Job *cont;
+    if (cmd.test_arg(1, type_job)) {
+      cmd.check_init(1, "continuation not initialized");
+      if (!cmd.ok())
+        return cmd.status();
+      cont = cmd.shared_arg<Job>(1);
+      if (cont->pool)
+        return cmd.abort("continuation has already been scheduled");
+    } else {
+      cont = new ProcJob((char *)(cmd.arg(1)));
+    }
+    // The continuation runs right away if job has already finished, so
+    // a reference must be held until it is returned.
+    acquireShared(cont);
+    size_t nargs = cont->args.size();
+    for (leftv a = arg->next->next; a != NULL; a = a->next) {
+      cont->args.push_back(LinTree::to_string(a));
+    }
+    if (!then(job, cont)) {
+      truncateArgs(cont, nargs);
+      releaseShared(cont);
+      return cmd.abort("job queue is full");
+    }
+    cmd.set_result(type_job, new_shared(cont));
+    releaseShared(cont);
+  }
+  return cmd.status();
+}
+
+static BOOLEAN combineJobs(Command &cmd, Job *combinator) {
+  cmd.check_argc(1);
+  cmd.check_arg(0, LIST_CMD, "argument must be a list of jobs");
+  if (!cmd.ok()) {
+    delete combinator;
+    return cmd.status();
+  }
+  lists l = (lists) cmd.arg(0);
+  int n = lSize(l) + 1;
+  vector<Job *> jobs;
+  for (int i = 0; i < n; i++) {
+    if (l->m[i].Typ() != type_job || !*(Job **)(l->m[i].Data())) {
+      delete combinator;
+      return cmd.abort("argument must be a list of jobs");
+    }
+    jobs.push_back(*(Job **)(l->m[i].Data()));
+  }
+  if (n == 0) {
+    delete combinator;
+    return cmd.abort("list of jobs must not be empty");
+  }
+  for (int i = 0; i < n; i++) {
+    if (!jobs[i]->pool) {
+      delete combinator;
+      return cmd.abort("job has not yet been scheduled");
+    }
+    if (jobs[i]->pool != jobs[0]->pool) {
+      delete combinator;
+      return cmd.abort("jobs have been scheduled on different threadpools");
+    }
+  }
+  if (!scheduleCombinator(combinator, n, &jobs[0]))
+    return cmd.abort("job queue is full");
+  cmd.set_result(type_job, new_shared(combinator));
+  releaseShared(combinator);
+  return cmd.status();
+}
+
+static BOOLEAN whenAll(leftv result, leftv arg) {
+  Command cmd("whenAll", result, arg);
+  return combineJobs(cmd, new WhenAllJob());
+}
+
+static BOOLEAN whenAny(leftv result, leftv arg) {
+  Command cmd("whenAny", result, arg);
+  return combineJobs(cmd, new WhenAnyJob());
+}
+
+static BOOLEAN parallelMap(leftv result, leftv arg) {
+  Command cmd("parallelMap", result, arg);
+  cmd.check_argc_min(2);
+  int has_pool = cmd.test_arg(0, type_threadpool);
+  cmd.check_argc(2+has_pool, 3+has_pool);
+  if (has_pool)
+    cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(has_pool, STRING_CMD, "procedure name must be a string");
+  cmd.check_arg(has_pool+1, LIST_CMD, "argument must be a list");
+  if (cmd.nargs() == 3+has_pool)
+    cmd.check_arg(has_pool+2, INT_CMD, "grain size must be an integer");
+  if (!cmd.ok()) return cmd.status();
+  ThreadPool *pool;
+  if (has_pool)
+    pool = cmd.shared_arg<ThreadPool>(0);
+  else {
+    if (!currentThreadPoolRef)
+      return cmd.abort("no current threadpool defined");
+    pool = currentThreadPoolRef;
+  }
+  lists l = (lists) cmd.arg(has_pool+1);
+  long n = lSize(l) + 1;
+  long nthreads = pool->scheduler->numWorkers();
+  long grain = n / (16 * nthreads);
+  if (cmd.nargs() == 3+has_pool) {
+    grain = cmd.int_arg(has_pool+2);
+    if (grain <= 0)
+      return cmd.abort("grain size must be positive");
+  }
+  if (grain < 1) grain = 1;
+  lists out = (lists) omAlloc0Bin(slists_bin);
+  out->Init(n);
+  if (n == 0) {
+    cmd.set_result(LIST_CMD, out);
+    return cmd.status();
+  }
+  MapTask task((const char *) cmd.arg(has_pool));
+  // Encode the elements of each block through a temporary list that
+  // shares them with the argument.
+  for (long lo = 0; lo < n; lo += grain) {
+    long size = std::min(grain, n - lo);
+    lists block = (lists) omAlloc0Bin(slists_bin);
+    block->Init(size);
+    memcpy(block->m, l->m + lo, size * sizeof(sleftv));
+    sleftv val;
+    memset(&val, 0, sizeof(val));
+    val.rtyp = LIST_CMD;
+    val.data = block;
+    task.blocks.push_back(LinTree::to_string(&val));
+    memset(block->m, 0, size * sizeof(sleftv));
+    val.CleanUp();
+  }
+  task.results.resize(task.blocks.size());
+  Job *root = new MapJob(&task, 0, task.blocks.size());
+  acquireShared(root);
+  pool->scheduler->enqueueJob(pool, root);
+  if (pool->scheduler->isSingleThreaded()) {
+    pool->waitJob(root);
+  } else
+    awaitJobs(task.waiter);
+  releaseShared(root);
+  long pos = 0;
+  for (long b = 0; b < task.results.size(); b++) {
+    if (task.results[b].size() == 0) {
+      sleftv val;
+      memset(&val, 0, sizeof(val));
+      val.rtyp = LIST_CMD;
+      val.data = out;
+      val.CleanUp();
+      return cmd.abort(task.failed ? "procedure call failed"
+        : "computation was cancelled");
+    }
+    leftv val = LinTree::from_string(task.results[b]);
+    lists part = (lists) val->data;
+    long size = lSize(part) + 1;
+    memcpy(out->m + pos, part->m, size * sizeof(sleftv));
+    memset(part->m, 0, size * sizeof(sleftv));
+    pos += size;
+    val->CleanUp();
+    omFreeBin(val, sleftv_bin);
+  }
+  cmd.set_result(LIST_CMD, out);
+  return cmd.status();
+}
+
+// Attach the jobs of a reduction tree in one batch, so that the
+// scheduler lock is only taken once. edges[i] combines the results of
+// the two jobs in deps[2*i] and deps[2*i+1].
+static bool scheduleReduction(ThreadPool *pool, vector<Job *> &jobs,
+    vector<Job *> &edges, vector<Job *> &deps) {
+  Scheduler *scheduler = pool->scheduler;
+  scheduler->lock.lock();
+  if (scheduler->admitJobs(jobs.size(), false) == AdmitReject) {
+    scheduler->lock.unlock();
+    return false;
+  }
+  for (long i = 0; i < edges.size(); i++) {
+    edges[i]->addDep(2, &deps[2*i]);
+    deps[2*i]->addNotify(edges[i]);
+    deps[2*i+1]->addNotify(edges[i]);
+  }
+  for (long i = 0; i < jobs.size(); i++) {
+    acquireShared(jobs[i]);
+    scheduler->enqueueJob(pool, jobs[i]);
+  }
+  scheduler->lock.unlock();
+  return true;
+}
+
+static bool byResultSize(Job *a, Job *b) {
+  return a->result.size() < b->result.size();
+}
+
+static BOOLEAN parallelReduce(leftv result, leftv arg) {
+  Command cmd("parallelReduce", result, arg);
+  cmd.check_argc_min(2);
+  int has_pool = cmd.test_arg(0, type_threadpool);
+  int has_leaf = cmd.test_arg(has_pool+2, STRING_CMD);
+  int has_flag = cmd.nargs() > has_pool+2+has_leaf;
+  cmd.check_argc(2+has_pool+has_leaf+has_flag);
+  if (has_pool)
+    cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(has_pool, STRING_CMD, "procedure name must be a string");
+  cmd.check_arg(has_pool+1, LIST_CMD, INTVEC_CMD,
+    "argument must be a list or intvec");
+  if (has_flag)
+    cmd.check_arg(has_pool+2+has_leaf, INT_CMD,
+      "commutativity flag must be an integer");
+  if (!cmd.ok()) return cmd.status();
+  ThreadPool *pool;
+  if (has_pool)
+    pool = cmd.shared_arg<ThreadPool>(0);
+  else {
+    if (!currentThreadPoolRef)
+      return cmd.abort("no current threadpool defined");
+    pool = currentThreadPoolRef;
+  }
+  const char *combine = (const char *) cmd.arg(has_pool);
+  const char *leaf = has_leaf ? (const char *) cmd.arg(has_pool+2) : "";
+  bool commutative = has_flag && cmd.int_arg(has_pool+2+has_leaf) != 0;
+  vector<string> elems;
+  if (cmd.argtype(has_pool+1) == LIST_CMD) {
+    lists l = (lists) cmd.arg(has_pool+1);
+    for (int i = 0; i <= lSize(l); i++)
+      elems.push_back(LinTree::to_string(&l->m[i]));
+  } else {
+    intvec *v = (intvec *) cmd.arg(has_pool+1);
+    for (int i = 0; i < v->length(); i++) {
+      sleftv val;
+      memset(&val, 0, sizeof(val));
+      val.rtyp = INT_CMD;
+      val.data = (char *)(long)((*v)[i]);
+      elems.push_back(LinTree::to_string(&val));
+    }
+  }
+  long n = elems.size();
+  if (n == 0)
+    return cmd.abort("argument must not be empty");
+  // Fold runs of consecutive elements in leaf jobs, a few per worker.
+  long nleaves = std::min(n, 4L * pool->scheduler->numWorkers());
+  vector<Job *> jobs, edges, deps;
+  vector<Job *> level;
+  for (long k = 0; k < nleaves; k++) {
+    Job *job = new ReduceLeafJob(combine, leaf);
+    for (long i = k * n / nleaves; i < (k+1) * n / nleaves; i++)
+      job->args.push_back(elems[i]);
+    jobs.push_back(job);
+    level.push_back(job);
+  }
+  Job *root = NULL;
+  bool failed = false;
+  if (!commutative) {
+    // Balanced tree over the leaves in their original order; an odd
+    // job out moves up to the next level unchanged.
+    while (level.size() > 1) {
+      vector<Job *> next;
+      for (long i = 0; i + 1 < level.size(); i += 2) {
+        Job *job = new ProcJob(combine);
+        jobs.push_back(job);
+        edges.push_back(job);
+        deps.push_back(level[i]);
+        deps.push_back(level[i+1]);
+        next.push_back(job);
+      }
+      if (level.size() % 2)
+        next.push_back(level.back());
+      level.swap(next);
+    }
+    if (!scheduleReduction(pool, jobs, edges, deps)) {
+      for (long i = 0; i < jobs.size(); i++)
+        delete jobs[i];
+      return cmd.abort("job queue is full");
+    }
+    root = level[0];
+    pool->waitJob(root);
+  } else {
+    if (!scheduleReduction(pool, jobs, edges, deps)) {
+      for (long i = 0; i < jobs.size(); i++)
+        delete jobs[i];
+      return cmd.abort("job queue is full");
+    }
+    // Combine results as they become available, smallest first, so
+    // that expensive combinations happen as late and as rarely as
+    // possible (as in Huffman coding).
+    vector<Job *> outstanding = level, ready;
+    while (!outstanding.empty() && !failed) {
+      vector<long> finished;
+      waitForJobs(outstanding.size(), &outstanding[0], 1, finished);
+      for (long k = finished.size() - 1; k >= 0; k--) {
+        Job *job = outstanding[finished[k]];
+        outstanding.erase(outstanding.begin() + finished[k]);
+        pool->scheduler->fetchResult(job);
+        if (job->cancelled || job->result.size() == 0)
+          failed = true;
+        ready.push_back(job);
+      }
+      std::sort(ready.begin(), ready.end(), byResultSize);
+      while (ready.size() >= 2 && !failed) {
+        Job *job = new ProcJob(combine);
+        if (!scheduleJob(pool, job, 2, &ready[0])) {
+          delete job;
+          failed = true;
+          break;
+        }
+        acquireShared(job);
+        jobs.push_back(job);
+        outstanding.push_back(job);
+        ready.erase(ready.begin(), ready.begin() + 2);
+      }
+    }
+    for (long i = 0; i < outstanding.size(); i++)
+      cancelJob(outstanding[i]);
+    if (!failed)
+      root = ready[0];
+  }
+  leftv val = NULL;
+  if (root && !root->cancelled) {
+    pool->scheduler->fetchResult(root);
+    if (root->result.size() > 0)
+      val = LinTree::from_string(root->result);
+  }
+  for (long i = 0; i < jobs.size(); i++)
+    releaseShared(jobs[i]);
+  if (!val)
+    return cmd.abort("reduction failed");
+  cmd.set_result(val->Typ(), val->Data());
+  omFreeBin(val, sleftv_bin);
+  return cmd.status();
+}
+
+// Default limit on the number of primes used by parallelModular(); far
+// more than any result that can be lifted in practice needs.
+#define MAX_MODULAR_PRIMES 10000
+
+// The largest prime below p, or 2 if there is none. Primes for modular
+// computations fit into 31 bits, so trial division is cheap compared to
+// the computations.
+static long prevPrime(long p) {
+  for (p--; p > 2; p--) {
+    if (p % 2 == 0) continue;
+    bool prime = true;
+    for (long d = 3; d * d <= p; d += 2) {
+      if (p % d == 0) {
+        prime = false;
+        break;
+      }
+    }
+    if (prime) return p;
+  }
+  return 2;
+}
+
+// Combine the residues acc (modulo modulus) and val (modulo prime)
+// into acc, modulo their product. Consumes val.
+static BOOLEAN chineseRemainder(sleftv &acc, sleftv &modulus, leftv val,
+    long prime) {
+  sleftv residues, moduli, p, combined, product;
+  memset(&residues, 0, sizeof(residues));
+  memset(&moduli, 0, sizeof(moduli));
+  memset(&p, 0, sizeof(p));
+  p.rtyp = BIGINT_CMD;
+  p.data = n_Init(prime, coeffs_BIGINT);
+  lists l = (lists) omAlloc0Bin(slists_bin);
+  l->Init(2);
+  memcpy(&l->m[0], &acc, sizeof(acc));
+  memcpy(&l->m[1], val, sizeof(*val));
+  memset(&acc, 0, sizeof(acc));
+  memset(val, 0, sizeof(*val));
+  residues.rtyp = LIST_CMD;
+  residues.data = l;
+  l = (lists) omAlloc0Bin(slists_bin);
+  l->Init(2);
+  l->m[0].Copy(&modulus);
+  l->m[1].Copy(&p);
+  moduli.rtyp = LIST_CMD;
+  moduli.data = l;
+  BOOLEAN error = iiExprArith2(&combined, &residues, CHINREM_CMD, &moduli);
+  if (!error)
+    error = iiExprArith2(&product, &modulus, '*', &p);
+  residues.CleanUp();
+  moduli.CleanUp();
+  p.CleanUp();
+  if (error)
+    return TRUE;
+  modulus.CleanUp();
+  memcpy(&acc, &combined, sizeof(combined));
+  memcpy(&modulus, &product, sizeof(product));
+  return FALSE;
+}
+
+static BOOLEAN parallelModular(leftv result, leftv arg) {
+  Command cmd("parallelModular", result, arg);
+  cmd.check_argc_min(2);
+  int has_pool = cmd.test_arg(0, type_threadpool);
+  cmd.check_argc(2+has_pool, 4+has_pool);
+  if (has_pool)
+    cmd.check_init(0, "threadpool not initialized");
+  cmd.check_arg(has_pool, STRING_CMD, "procedure name must be a string");
+  cmd.check_arg(has_pool+1, LIST_CMD, "arguments must be a list");
+  if (cmd.nargs() >= 3+has_pool)
+    cmd.check_arg(has_pool+2, INT_CMD, "interval must be an integer");
+  if (cmd.nargs() == 4+has_pool)
+    cmd.check_arg(has_pool+3, INT_CMD, "prime limit must be an integer");
+  if (!cmd.ok()) return cmd.status();
+  ThreadPool *pool;
+  if (has_pool)
+    pool = cmd.shared_arg<ThreadPool>(0);
+  else {
+    if (!currentThreadPoolRef)
+      return cmd.abort("no current threadpool defined");
+    pool = currentThreadPoolRef;
+  }
+  const char *procname = (const char *) cmd.arg(has_pool);
+  lists l = (lists) cmd.arg(has_pool+1);
+  long nthreads = pool->scheduler->numWorkers();
+  long interval = nthreads;
+  if (cmd.nargs() >= 3+has_pool) {
+    interval = cmd.int_arg(has_pool+2);
+    if (interval <= 0)
+      return cmd.abort("interval must be positive");
+  }
+  long maxprimes = MAX_MODULAR_PRIMES;
+  if (cmd.nargs() == 4+has_pool) {
+    maxprimes = cmd.int_arg(has_pool+3);
+    if (maxprimes <= 0)
+      return cmd.abort("prime limit must be positive");
+  }
+  vector<string> args;
+  for (int i = 0; i <= lSize(l); i++)
+    args.push_back(LinTree::to_string(&l->m[i]));
+  // Keep enough jobs in flight that workers do not run dry while the
+  // caller folds in results.
+  long inflight = 2 * nthreads;
+  vector<Job *> outstanding;
+  vector<long> primes;
+  long prime = 2147483648L;
+  sleftv acc, modulus;
+  memset(&acc, 0, sizeof(acc));
+  memset(&modulus, 0, sizeof(modulus));
+  bool have = false;
+  long pending_check = 0;
+  long started = 0;
+  string last;
+  leftv answer = NULL;
+  const char *error = NULL;
+  while (!answer && !error) {
+    while (outstanding.size() < inflight && started < maxprimes) {
+      prime = prevPrime(prime);
+      if (prime <= 2) {
+        error = "ran out of primes";
+        break;
+      }
+      Job *job = new ProcJob(procname);
+      sleftv p;
+      memset(&p, 0, sizeof(p));
+      p.rtyp = INT_CMD;
+      p.data = (char *) prime;
+      job->args.push_back(LinTree::to_string(&p));
+      for (int i = 0; i < args.size(); i++) {
+        job->args.push_back(args[i]);
+        acquireEncoding(job->args.back());
+      }
+      if (!startJob(pool, job)) {
+        delete job;
+        error = "job queue is full";
+        break;
+      }
+      acquireShared(job);
+      outstanding.push_back(job);
+      primes.push_back(prime);
+      started++;
+    }
+    if (error) break;
+    if (outstanding.empty()) {
+      error = "no stable result within the prime limit";
+      break;
+    }
+    vector<long> finished;
+    waitForJobs(outstanding.size(), &outstanding[0], 1, finished);
+    for (long k = finished.size() - 1; k >= 0; k--) {
+      long i = finished[k];
+      Job *job = outstanding[i];
+      long p = primes[i];
+      outstanding.erase(outstanding.begin() + i);
+      primes.erase(primes.begin() + i);
+      pool->scheduler->fetchResult(job);
+      if (!error && (job->cancelled || job->result.size() == 0))
+        error = "procedure call failed";
+      if (!error) {
+        leftv val = LinTree::from_string(job->result);
+        if (!have) {
+          memcpy(&acc, val, sizeof(acc));
+          modulus.rtyp = BIGINT_CMD;
+          modulus.data = n_Init(p, coeffs_BIGINT);
+          have = true;
+        } else if (chineseRemainder(acc, modulus, val, p)) {
+          val->CleanUp();
+          error = "chinese remaindering failed";
+        }
+        omFreeBin(val, sleftv_bin);
+        pending_check++;
+      }
+      releaseShared(job);
+    }
+    // Reconstruct periodically; the result is final once it no longer
+    // changes when more primes are added. The results for the last
+    // primes are always tried.
+    bool exhausted = started >= maxprimes && outstanding.empty();
+    if (!error && pending_check > 0
+        && (pending_check >= interval || exhausted)) {
+      pending_check = 0;
+      sleftv rec;
+      if (iiExprArith2(&rec, &acc, FAREY_CMD, &modulus)) {
+        error = "rational reconstruction failed";
+      } else {
+        string encoding = LinTree::to_string(&rec);
+        if (encoding == last) {
+          answer = (leftv) omAlloc0Bin(sleftv_bin);
+          memcpy(answer, &rec, sizeof(rec));
+        } else {
+          last.swap(encoding);
+          rec.CleanUp();
+        }
+      }
+    }
+  }
+  for (long i = 0; i < outstanding.size(); i++) {
+    cancelJob(outstanding[i]);
+    releaseShared(outstanding[i]);
+  }
+  releaseEncodings(args);
+  if (have) {
+    acc.CleanUp();
+    modulus.CleanUp();
+  }
+  if (error)
+    return cmd.abort(error);
+  cmd.set_result(answer->Typ(), answer->Data());
+  omFreeBin(answer, sleftv_bin);
   return cmd.status();
 }
 
@@ -2793,12 +6708,14 @@ BOOLEAN threadEval(leftv result, leftv arg) {
   ThreadState *ts = thread->getThreadState();
   if (ts && ts->parent != pthread_self()) {
     WerrorS("threadEval: can only be called from parent thread");
+    releaseEncoding(expr);
     return TRUE;
   }
   if (ts) ts->lock.lock();
   if (!ts || !ts->running || !ts->active) {
     WerrorS("threadEval: thread is no longer running");
     if (ts) ts->lock.unlock();
+    releaseEncoding(expr);
     return TRUE;
   }
   ts->to_thread.push("e");
@@ -2821,12 +6738,14 @@ BOOLEAN threadExec(leftv result, leftv arg) {
   ThreadState *ts = thread->getThreadState();
   if (ts && ts->parent != pthread_self()) {
     WerrorS("threadExec: can only be called from parent thread");
+    releaseEncoding(expr);
     return TRUE;
   }
   if (ts) ts->lock.lock();
   if (!ts || !ts->running || !ts->active) {
     WerrorS("threadExec: thread is no longer running");
     if (ts) ts->lock.unlock();
+    releaseEncoding(expr);
     return TRUE;
   }
   ts->to_thread.push("x");
@@ -2855,7 +6774,7 @@ BOOLEAN threadPoolExec(leftv result, leftv arg) {
     string expr = LinTree::to_string(has_pool ? arg->next : arg);
     Job* job = new ExecJob();
     job->args.push_back(expr);
-    job->pool = pool;
+    job->setPool(pool);
     pool->broadcastJob(job);
   }
   return cmd.status();
@@ -2887,6 +6806,7 @@ BOOLEAN threadResult(leftv result, leftv arg) {
   ts->from_thread.pop();
   ts->lock.unlock();
   leftv val = LinTree::from_string(expr);
+  releaseEncoding(expr);
   result->rtyp = val->Typ();
   result->data = val->Data();
   return FALSE;
@@ -2950,6 +6870,7 @@ extern "C" int mod_init(SModulFunctions *fn)
   makeSharedType(type_threadpool, "threadpool");
   makeSharedType(type_job, "job");
   makeSharedType(type_trigger, "trigger");
+  makeSharedType(type_jobgroup, "jobgroup");
   makeRegionlockType(type_regionlock, "regionlock");
 
   fn->iiAddCproc(libname, "putTable", FALSE, putTable);
@@ -2978,6 +6899,7 @@ extern "C" int mod_init(SModulFunctions *fn)
   fn->iiAddCproc(libname, "findSharedObject", FALSE, findSharedObject);
   fn->iiAddCproc(libname, "bindSharedObject", FALSE, bindSharedObject);
   fn->iiAddCproc(libname, "typeSharedObject", FALSE, typeSharedObject);
+  fn->iiAddCproc(libname, "sharedObjectStats", FALSE, sharedObjectStats);
 
   fn->iiAddCproc(libname, "createThread", FALSE, createThread);
   fn->iiAddCproc(libname, "joinThread", FALSE, joinThread);
@@ -2985,6 +6907,14 @@ extern "C" int mod_init(SModulFunctions *fn)
   fn->iiAddCproc(libname, "closeThreadPool", FALSE, closeThreadPool);
   fn->iiAddCproc(libname, "currentThreadPool", FALSE, currentThreadPool);
   fn->iiAddCproc(libname, "setCurrentThreadPool", FALSE, setCurrentThreadPool);
+  fn->iiAddCproc(libname, "setThreadPoolMemoryLimit", FALSE, setThreadPoolMemoryLimit);
+  fn->iiAddCproc(libname, "setThreadPoolQueueLimit", FALSE, setThreadPoolQueueLimit);
+  fn->iiAddCproc(libname, "setThreadPoolSpin", FALSE, setThreadPoolSpin);
+  fn->iiAddCproc(libname, "setThreadPoolWeight", FALSE, setThreadPoolWeight);
+  fn->iiAddCproc(libname, "setCoreBudget", FALSE, setCoreBudget);
+  fn->iiAddCproc(libname, "setThreadPoolCache", FALSE, setThreadPoolCache);
+  fn->iiAddCproc(libname, "threadPoolCacheStats", FALSE, threadPoolCacheStats);
+  fn->iiAddCproc(libname, "setThreadPoolDiskCache", FALSE, setThreadPoolDiskCache);
   fn->iiAddCproc(libname, "threadPoolExec", FALSE, threadPoolExec);
   fn->iiAddCproc(libname, "threadID", FALSE, threadID);
   fn->iiAddCproc(libname, "mainThread", FALSE, mainThread);
@@ -2996,11 +6926,31 @@ extern "C" int mod_init(SModulFunctions *fn)
   fn->iiAddCproc(libname, "setSharedName", FALSE, setSharedName);
   fn->iiAddCproc(libname, "getSharedName", FALSE, getSharedName);
   fn->iiAddCproc(libname, "startJob", FALSE, startJob);
+  fn->iiAddCproc(libname, "startJobOn", FALSE, startJobOn);
   fn->iiAddCproc(libname, "waitJob", FALSE, waitJob);
+  fn->iiAddCproc(libname, "waitJobs", FALSE, waitJobs);
+  fn->iiAddCproc(libname, "onJobDone", FALSE, onJobDone);
+  fn->iiAddCproc(libname, "jobEmit", FALSE, jobEmit);
+  fn->iiAddCproc(libname, "jobHasNext", FALSE, jobHasNext);
+  fn->iiAddCproc(libname, "jobNext", FALSE, jobNext);
+  fn->iiAddCproc(libname, "setJobStreamCapacity", FALSE, setJobStreamCapacity);
   fn->iiAddCproc(libname, "cancelJob", FALSE, cancelJob);
   fn->iiAddCproc(libname, "jobCancelled", FALSE, jobCancelled);
+  fn->iiAddCproc(libname, "setJobMemory", FALSE, setJobMemory);
+  fn->iiAddCproc(libname, "jobResultOnce", FALSE, jobResultOnce);
   fn->iiAddCproc(libname, "scheduleJob", FALSE, scheduleJob);
   fn->iiAddCproc(libname, "scheduleJobs", FALSE, scheduleJob);
+  fn->iiAddCproc(libname, "then", FALSE, then);
+  fn->iiAddCproc(libname, "whenAll", FALSE, whenAll);
+  fn->iiAddCproc(libname, "parallelMap", FALSE, parallelMap);
+  fn->iiAddCproc(libname, "parallelReduce", FALSE, parallelReduce);
+  fn->iiAddCproc(libname, "parallelModular", FALSE, parallelModular);
+  fn->iiAddCproc(libname, "whenAny", FALSE, whenAny);
+  fn->iiAddCproc(libname, "createJobGroup", FALSE, createJobGroup);
+  fn->iiAddCproc(libname, "currentJobGroup", FALSE, currentJobGroup);
+  fn->iiAddCproc(libname, "setCurrentJobGroup", FALSE, setCurrentJobGroup);
+  fn->iiAddCproc(libname, "waitGroup", FALSE, waitGroup);
+  fn->iiAddCproc(libname, "cancelGroup", FALSE, cancelGroup);
   fn->iiAddCproc(libname, "createTrigger", FALSE, createTrigger);
   fn->iiAddCproc(libname, "updateTrigger", FALSE, updateTrigger);
   fn->iiAddCproc(libname, "testTrigger", FALSE, testTrigger);
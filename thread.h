@@ -5,6 +5,7 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <alloca.h>
+#include <time.h>
 #include <cstddef>
 #include <exception>
 
@@ -79,7 +80,7 @@ private:
   friend class Semaphore;
   ConditionVariable() { }
 public:
-  ConditionVariable(Lock *lock_init) : waiting(0), lock(lock_init) {
+  ConditionVariable(Lock *lock_init) : lock(lock_init), waiting(0) {
     pthread_cond_init(&condition, NULL);
   }
   ~ConditionVariable() {
@@ -94,6 +95,24 @@ public:
     waiting--;
     lock->resume_lock(l);
   }
+  // Like wait(), but returns after at most msec milliseconds.
+  void timed_wait(long msec) {
+    if (!lock->is_locked())
+      ThreadError("waited on condition without locked mutex");
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += msec / 1000;
+    deadline.tv_nsec += (msec % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    waiting++;
+    int l = lock->break_lock();
+    pthread_cond_timedwait(&condition, &lock->mutex, &deadline);
+    waiting--;
+    lock->resume_lock(l);
+  }
   void signal() {
     if (!lock->is_locked())
       ThreadError("signaled condition without locked mutex");